@@ -23,10 +23,17 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <math.h>
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
@@ -34,26 +41,417 @@
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/Utils.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h> // for property_get
 
 namespace android {
 
+// The C library doesn't necessarily wrap recvmmsg() and sendmmsg(), they
+// are invoked through syscall() wherever the kernel headers define them and
+// only the per-packet receive and send paths are built otherwise.
+#ifdef __NR_recvmmsg
+#define HAVE_RECVMMSG 1
+#endif
+
+#ifdef __NR_sendmmsg
+#define HAVE_SENDMMSG 1
+#endif
+
 static const size_t kMaxUDPSize = 1500;
 
+// SO_RCVBUF/SO_SNDBUF of UDP sessions unless overridden by SessionOptions.
+static const int kDefaultUDPBufferSize = 256 * 1024;
+
+// Upper bound on the number of datagrams pulled by a single recvmmsg()
+// or pushed by a single sendmmsg().
+static const size_t kMaxDatagramBatchSize = 64;
+
+// Upper bound on the number of datagrams handed to a single sendmmsg(),
+// counting every segment of a UDP GSO message.
+static const size_t kMaxSendIovecs = 256;
+
+#ifdef UDP_SEGMENT
+// Kernel limits for a single UDP GSO (generic segmentation offload) send.
+static const size_t kMaxGSOSegments = 64;
+static const size_t kMaxGSOSize = 65507;
+#endif
+
+// Resolution at which the network thread wakes up to let paced datagrams
+// out, it waits with millisecond timeouts.
+static const int64_t kPacingResolutionUs = 1000ll;
+
+// Upper bound on the number of receive buffers recycled per session.
+static const size_t kMaxPooledBuffers = 256;
+
+// Upper bound on the number of queued chunks handed to a single sendmsg()
+// on stream sessions.
+static const size_t kMaxStreamIovecs = 64;
+
+// Stream sessions receive into a buffer of this size and compact or replace
+// it once less than kMinStreamReadSize bytes are left at its end.
+static const size_t kStreamBufferSize = 65536;
+static const size_t kMinStreamReadSize = 4096;
+
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+// Same layout as the kernel's struct mmsghdr.
+struct ANetworkSession::MultiMessage {
+    struct msghdr mHeader;
+    unsigned int mLength;
+};
+#endif
+
 struct ANetworkSession::NetworkThread : public Thread {
-    NetworkThread(ANetworkSession *session);
+    NetworkThread(Shard *shard);
 
 protected:
     virtual ~NetworkThread();
 
 private:
-    ANetworkSession *mSession;
+    Shard *mShard;
 
     virtual bool threadLoop();
 
     DISALLOW_EVIL_CONSTRUCTORS(NetworkThread);
 };
 
+// Readiness notification backend used by the network thread. Every
+// registered descriptor is tagged with an id, either the ID of the session
+// owning the socket or kWakeupID for the wakeup eventfd.
+struct ANetworkSession::Poller : public RefBase {
+    enum {
+        kEventRead  = 1,
+        kEventWrite = 2,
+    };
+
+    enum {
+        kWakeupID = 0,
+    };
+
+    Poller() {}
+
+    virtual status_t initCheck() const = 0;
+
+    virtual status_t add(int fd, int32_t id, uint32_t events) = 0;
+    virtual status_t modify(int fd, int32_t id, uint32_t events) = 0;
+    virtual status_t remove(int fd) = 0;
+
+    // Blocks until at least one descriptor is ready and returns the number
+    // of events available through eventAt(), or a negative error code.
+    // Blocks for at most "timeoutMs" milliseconds, indefinitely if negative.
+    virtual ssize_t wait(int timeoutMs) = 0;
+    virtual void eventAt(size_t index, int32_t *id, uint32_t *events) const = 0;
+
+protected:
+    virtual ~Poller() {}
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(Poller);
+};
+
+// Portable fallback, rebuilds the fd_sets from the registration table on
+// every wait().
+struct ANetworkSession::SelectPoller : public Poller {
+    SelectPoller();
+
+    virtual status_t initCheck() const;
+
+    virtual status_t add(int fd, int32_t id, uint32_t events);
+    virtual status_t modify(int fd, int32_t id, uint32_t events);
+    virtual status_t remove(int fd);
+
+    virtual ssize_t wait(int timeoutMs);
+    virtual void eventAt(size_t index, int32_t *id, uint32_t *events) const;
+
+protected:
+    virtual ~SelectPoller();
+
+private:
+    struct Entry {
+        int32_t mID;
+        uint32_t mEvents;
+    };
+
+    Mutex mLock;
+    KeyedVector<int, Entry> mEntries;
+
+    Vector<Entry> mReadyEvents;
+
+    DISALLOW_EVIL_CONSTRUCTORS(SelectPoller);
+};
+
+// Edge-triggered epoll backend, interest changes are applied incrementally
+// through epoll_ctl and are picked up by a concurrent epoll_wait. Since only
+// readiness transitions are reported, sessions always read/write until EAGAIN.
+struct ANetworkSession::EPollPoller : public Poller {
+    EPollPoller();
+
+    virtual status_t initCheck() const;
+
+    virtual status_t add(int fd, int32_t id, uint32_t events);
+    virtual status_t modify(int fd, int32_t id, uint32_t events);
+    virtual status_t remove(int fd);
+
+    virtual ssize_t wait(int timeoutMs);
+    virtual void eventAt(size_t index, int32_t *id, uint32_t *events) const;
+
+protected:
+    virtual ~EPollPoller();
+
+private:
+    enum {
+        kMaxEvents = 64,
+    };
+
+    int mFd;
+    struct epoll_event mEvents[kMaxEvents];
+
+    status_t control(int op, int fd, int32_t id, uint32_t events);
+
+    DISALLOW_EVIL_CONSTRUCTORS(EPollPoller);
+};
+
+// A set of fixed-size ABuffers for the receive paths that are recycled
+// instead of freed. The pool itself holds a reference to every buffer it
+// owns, so a buffer whose strong count dropped back to 1 is no longer
+// referenced by any client and can be handed out again.
+struct ANetworkSession::BufferPool : public RefBase {
+    BufferPool(size_t bufferSize, size_t maxBuffers);
+
+    // Returns a buffer with its range set to [0, size). Requests larger
+    // than the pool's buffer size or made while all "maxBuffers" buffers
+    // are outstanding are served by a plain heap allocation.
+    sp<ABuffer> acquire(size_t size);
+
+    size_t hits() const;
+    size_t misses() const;
+
+    // Largest number of buffers, pooled or not, found outstanding at the
+    // same time. Exceeds "maxBuffers" by as much as demand went past the
+    // pool's capacity.
+    size_t highWaterMark() const;
+
+protected:
+    virtual ~BufferPool();
+
+private:
+    struct UnpooledBuffer;
+
+    size_t mBufferSize;
+    size_t mMaxBuffers;
+
+    Vector<sp<ABuffer> > mBuffers;
+    size_t mNextIndex;
+
+    // Buffers handed out by plain heap allocation that are still
+    // referenced, they may be released on any thread.
+    volatile int32_t mNumUnpooledOutstanding;
+
+    size_t mHits;
+    size_t mMisses;
+    size_t mHighWaterMark;
+
+    sp<ABuffer> allocateUnpooled(size_t capacity);
+    void updateHighWaterMark(size_t numPooledOutstanding);
+
+    DISALLOW_EVIL_CONSTRUCTORS(BufferPool);
+};
+
+// A buffer the pool had to allocate beyond its capacity, counted as
+// outstanding until its last reference is gone. Keeps the pool alive so
+// the count can be updated.
+struct ANetworkSession::BufferPool::UnpooledBuffer : public ABuffer {
+    UnpooledBuffer(const sp<BufferPool> &pool, size_t capacity)
+        : ABuffer(capacity),
+          mPool(pool) {
+        android_atomic_inc(&mPool->mNumUnpooledOutstanding);
+    }
+
+protected:
+    virtual ~UnpooledBuffer() {
+        android_atomic_dec(&mPool->mNumUnpooledOutstanding);
+    }
+
+private:
+    sp<BufferPool> mPool;
+
+    DISALLOW_EVIL_CONSTRUCTORS(UnpooledBuffer);
+};
+
+// Zero-copy view of a range of a stream session's receive buffer, which is
+// kept alive for as long as the slice is referenced.
+struct ANetworkSession::BufferSlice : public ABuffer {
+    BufferSlice(const sp<ABuffer> &parent, size_t offset, size_t size)
+        : ABuffer(parent->base() + offset, size),
+          mParent(parent) {
+    }
+
+protected:
+    virtual ~BufferSlice() {}
+
+private:
+    sp<ABuffer> mParent;
+
+    DISALLOW_EVIL_CONSTRUCTORS(BufferSlice);
+};
+
+// A request handed from a client thread to the network thread, which is the
+// only thread touching a session's queues and poll registration.
+struct ANetworkSession::Command {
+    enum Type {
+        kTypeAddSession,
+        kTypeDestroySession,
+        kTypeSendRequest,
+        kTypeSendInterleavedData,
+        kTypeSetDatagramBatchSize,
+        kTypeConnect,
+        kTypeGetStats,
+        kTypeSetPacing,
+        kTypeSetMediaLatencyBudget,
+    };
+
+    enum {
+        kMaxBuffers = 4,
+    };
+
+    Command(Type type, int32_t sessionID)
+        : mNext(NULL),
+          mType(type),
+          mSessionID(sessionID),
+          mNumBuffers(0),
+          mQueuedUs(0ll),
+          mPriority(kPriorityMedia),
+          mPriorityBySession(false),
+          mDatagramBatchSize(0),
+          mPacingRate(0),
+          mPacingBurstBytes(0),
+          mStatus(OK),
+          mLatencyBudgetUs(0ll) {
+    }
+
+    Command *volatile mNext;
+
+    Type mType;
+    int32_t mSessionID;
+
+    sp<Session> mSession;               // kTypeAddSession
+    sp<ABuffer> mBuffers[kMaxBuffers];  // kTypeSendRequest/-InterleavedData
+    size_t mNumBuffers;
+    int64_t mQueuedUs;
+    Priority mPriority;
+    bool mPriorityBySession;            // overrides mPriority, see below
+    size_t mDatagramBatchSize;          // kTypeSetDatagramBatchSize
+
+    int32_t mPacingRate;                // kTypeSetPacing
+    size_t mPacingBurstBytes;
+
+    status_t mStatus;                   // kTypeConnect
+    struct sockaddr_in mRemoteAddr;
+
+    sp<AMessage> mReply;                // kTypeGetStats
+
+    int64_t mLatencyBudgetUs;           // kTypeSetMediaLatencyBudget
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(Command);
+};
+
+// Intrusive multi-producer single-consumer queue after Dmitry Vyukov's
+// design. push() never blocks and may be called from any thread, pop() is
+// only called on the network thread.
+struct ANetworkSession::CommandQueue : public RefBase {
+    CommandQueue();
+
+    void push(Command *cmd);
+
+    // Returns NULL once the queue is empty, or while the most recent push()
+    // has not linked its command yet. That producer interrupts the network
+    // thread after linking it, so the command is picked up on the next pass.
+    Command *pop();
+
+protected:
+    virtual ~CommandQueue();
+
+private:
+    Command *volatile mHead;  // Most recently pushed, shared by producers.
+    Command *mTail;           // Next to be popped, owned by the consumer.
+    Command mStub;
+
+    DISALLOW_EVIL_CONSTRUCTORS(CommandQueue);
+};
+
+// Default Resolver, getaddrinfo() is safe to call from any thread.
+struct ANetworkSession::AddrInfoResolver : public Resolver {
+    AddrInfoResolver() {}
+
+    virtual status_t resolve(const char *host, struct in_addr *addr);
+
+protected:
+    virtual ~AddrInfoResolver() {}
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(AddrInfoResolver);
+};
+
+// Resolves the remote hosts of sessions one at a time, without holding any
+// lock while blocked in the Resolver, and hands the result to the network
+// thread servicing the session as a kTypeConnect command.
+struct ANetworkSession::ResolverThread : public Thread {
+    ResolverThread(ANetworkSession *owner);
+
+    void queueRequest(
+            int32_t sessionID, const char *host, unsigned port,
+            const sp<Resolver> &resolver);
+
+    void stop();
+
+protected:
+    virtual ~ResolverThread();
+
+private:
+    struct Request {
+        int32_t mSessionID;
+        AString mHost;
+        unsigned mPort;
+        sp<Resolver> mResolver;
+    };
+
+    ANetworkSession *mOwner;
+
+    Mutex mLock;
+    Condition mCondition;
+    List<Request> mRequests;
+
+    virtual bool threadLoop();
+
+    DISALLOW_EVIL_CONSTRUCTORS(ResolverThread);
+};
+
+// Latencies in microseconds, counted in power-of-two buckets. Cheap enough
+// to update for every packet, percentiles are accurate to within a factor
+// of two which is plenty to spot stalls.
+struct ANetworkSession::LatencyHistogram {
+    enum {
+        // Bucket 0 counts zero latencies, bucket i > 0 those in
+        // [2^(i-1), 2^i) us, the last one everything from ~4 secs up.
+        kNumBuckets = 24,
+    };
+
+    LatencyHistogram();
+
+    void add(int64_t latencyUs);
+
+    uint32_t count() const { return mCount; }
+    int64_t maxUs() const { return mMaxUs; }
+
+    // Upper bound of the bucket holding the "percent"th percentile.
+    int64_t percentileUs(double percent) const;
+
+private:
+    uint32_t mBuckets[kNumBuckets];
+    uint32_t mCount;
+    int64_t mMaxUs;
+};
+
 struct ANetworkSession::Session : public RefBase {
     enum State {
         CONNECTING,
@@ -78,489 +476,2971 @@ struct ANetworkSession::Session : public RefBase {
     bool wantsToRead();
     bool wantsToWrite();
 
+    // The Poller events matching wantsToRead()/wantsToWrite() and the
+    // events the socket is currently registered for.
+    uint32_t pollEvents();
+    uint32_t registeredPollEvents() const;
+    void setRegisteredPollEvents(uint32_t events);
+
     status_t readMore();
     status_t writeMore();
 
-    status_t sendRequest(const void *data, ssize_t size);
+    // "queuedUs" is the time the client queued the request.
+    status_t sendRequest(
+            const sp<ABuffer> *buffers, size_t count, int64_t queuedUs,
+            Priority priority);
+
+    status_t setMediaLatencyBudget(int64_t budgetUs);
 
     void setIsRTSPConnection(bool yesno);
+    bool isRTSPConnection() const;
+
+    // The options the session was created with.
+    void setOptions(const SessionOptions &options);
+    const SessionOptions &options() const;
+
+    // While resolving, the socket is not connected yet and queued output is
+    // held back until completeConnect() is called.
+    void setResolving(bool resolving);
+    void completeConnect(status_t err, const struct sockaddr_in &addr);
+    status_t setDatagramBatchSize(size_t maxPackets);
+
+    // Token bucket limiting the rate datagrams are written at, see
+    // ANetworkSession::setPacing(). While blocked, pacingResumeUs() is the
+    // time the head of the queue may go out, the network thread wakes up
+    // for it and calls resumePacing().
+    status_t setPacing(int32_t bitsPerSecond, size_t burstBytes);
+    int64_t pacingResumeUs() const;
+    void resumePacing(int64_t nowUs);
+
+    void notifyError(bool send, status_t err, const char *detail);
+
+    // Counters are only updated on the session's network thread, which is
+    // also the only one reading them.
+    void recordDispatchLatency(int64_t latencyUs);
+    void getStats(const sp<AMessage> &msg) const;
+    void logStats() const;
+
+    // Single line JSON object holding the same counters as getStats().
+    AString statsAsJSON() const;
+
+    int64_t numPackets() const;
 
 protected:
     virtual ~Session();
 
 private:
+    enum {
+        // One output queue per Priority.
+        kNumLanes = 2,
+    };
+
+    // A request is queued as one or more entries, the last of which has
+    // mEndOfRequest set.
+    struct OutBuffer {
+        sp<ABuffer> mBuffer;
+        int64_t mQueuedUs;
+        int64_t mTimeUs;            // of the media frame, -1 if unknown
+        bool mEndOfRequest;
+        bool mEgressHookRan;
+    };
+
+    struct Stats {
+        Stats();
+
+        int64_t mPacketsIn;
+        int64_t mBytesIn;
+        int64_t mPacketsOut;
+        int64_t mBytesOut;
+        int64_t mNumEAGAIN;
+        int64_t mNumReceiveErrors;
+        int64_t mNumSendErrors;
+        size_t mQueueHighWaterMark;
+        LatencyHistogram mQueueDwell;
+        LatencyHistogram mDispatchLatency;
+        int64_t mNumPacingStalls;
+        LatencyHistogram mPacingDelay;
+        int64_t mNumMediaDropped;
+        int64_t mMediaBytesDropped;
+        int64_t mNumFramesDropped;
+
+        // Buffers allocated on the network thread to send requests, i.e.
+        // coalesced datagrams and length prefixes.
+        int64_t mNumSendAllocations;
+    };
+
+    struct StatsEntry {
+        const char *mName;
+        int64_t mValue;
+    };
+
     int32_t mSessionID;
     State mState;
     bool mIsRTSPConnection;
+    SessionOptions mOptions;
     int mSocket;
     sp<AMessage> mNotify;
     bool mSawReceiveFailure, mSawSendFailure;
+    bool mResolving;
+    uint32_t mRegisteredPollEvents;
+    size_t mDatagramBatchSize;
 
-    // for TCP / stream data
-    AString mOutBuffer;
+    // Datagrams or stream chunks, indexed by Priority.
+    List<OutBuffer> mOutQueues[kNumLanes];
 
-    // for UDP / datagrams
-    List<sp<ABuffer> > mOutDatagrams;
+    // Total number of entries in mOutQueues.
+    size_t mNumOutQueued;
 
-    AString mInBuffer;
+    // for TCP / stream data, the lane of the request that has been partially
+    // written (-1 at a request boundary), of whose first chunk the first
+    // mOutChunkOffset bytes have already been sent.
+    ssize_t mLaneInProgress;
+    size_t mOutChunkOffset;
+
+    // Queued media requests older than this are dropped, 0 if unlimited.
+    int64_t mMediaLatencyBudgetUs;
+
+    // Pacing is disabled while mPacingRate (in bits per second) is 0.
+    // mPacingTokens is the number of bytes that may be written right away,
+    // as of mPacingRefillUs. While mPacingBlocked the head of the queue
+    // waits for mPacingResumeUs instead of the socket to become writable.
+    int32_t mPacingRate;
+    size_t mPacingBurstBytes;
+    double mPacingTokens;
+    int64_t mPacingRefillUs;
+    bool mPacingBlocked;
+    int64_t mPacingBlockedUs;
+    int64_t mPacingResumeUs;
+
+    Stats mStats;
+
+    // for TCP / stream data, the unparsed bytes are the range of mInBuffer.
+    sp<ABuffer> mInBuffer;
+
+    bool mUseSendmmsg;
+    bool mUseGSO;
+
+    // Created on first use, only receiving sessions need one.
+    sp<BufferPool> mBufferPool;
+
+    sp<ABuffer> acquireBuffer(size_t size);
+
+    void makeRoomForRead();
+    void consumeInBuffer(size_t size);
+    sp<ABuffer> sliceInBuffer(size_t offset, size_t size);
+    void parseStreamData(bool noMoreData);
+
+    void consumeOutChunks(size_t size);
+
+    void queueOut(
+            List<OutBuffer> *queue, const sp<ABuffer> &buffer,
+            int64_t queuedUs, int64_t timeUs, bool endOfRequest);
+    void dequeueOut(List<OutBuffer> *queue, int64_t nowUs);
+
+    // Hands the datagram to the session's EgressHook unless it already
+    // saw it on an earlier attempt to send it.
+    void runEgressHook(OutBuffer *entry);
+
+    // Drops whole media requests that exceeded mMediaLatencyBudgetUs or
+    // their deadline, together with the rest of their frame.
+    void dropStaleMedia(int64_t nowUs);
+    bool isStale(const OutBuffer &entry, int64_t nowUs) const;
+
+    void refillPacingTokens(int64_t nowUs);
+    bool pacingAllows(double tokens, size_t size) const;
+    void blockOnPacer(size_t size, int64_t nowUs);
+
+#ifdef HAVE_RECVMMSG
+    status_t readDatagramBatch();
+#endif
+
+    void setArrivalTime(
+            const sp<ABuffer> &buffer, const struct msghdr *msg,
+            int64_t nowUs, int64_t nowRealTimeUs) const;
+#ifdef HAVE_SENDMMSG
+    status_t writeDatagramBatch(List<OutBuffer> *queue);
+#endif
+    status_t writeDatagrams(List<OutBuffer> *queue);
 
-    void notifyError(bool send, status_t err, const char *detail);
     void notify(NotificationReason reason);
 
+    void collectStats(Vector<StatsEntry> *entries) const;
+    static void AddStatsEntry(
+            Vector<StatsEntry> *entries, const char *name, int64_t value);
+
     DISALLOW_EVIL_CONSTRUCTORS(Session);
 };
+
+// One network thread with its own poller, wakeup eventfd, command queue and
+// table of registered sessions. A session is serviced by a single shard for
+// its whole lifetime, the shard's index is encoded in the session ID.
+struct ANetworkSession::Shard : public RefBase {
+    Shard(ANetworkSession *owner, size_t index);
+
+    status_t start();
+    status_t stop();
+
+    // May be called from any thread.
+    void pushCommand(Command *cmd);
+
+    void threadLoop();
+
+protected:
+    virtual ~Shard();
+
+private:
+    ANetworkSession *mOwner;
+    size_t mIndex;
+
+    sp<Thread> mThread;
+    sp<Poller> mPoller;
+
+    sp<CommandQueue> mCommands;
+
+    // Writers skip the eventfd write while a wakeup is already pending.
+    int mWakeupFd;
+    volatile int32_t mWakeupPending;
+    volatile int32_t mNumWakeupsIssued;
+    volatile int32_t mNumWakeupsCoalesced;
+
+    // Sessions registered with the poller, only touched on this shard's
+    // thread (or while it is stopped).
+    KeyedVector<int32_t, sp<Session> > mSessions;
+
+    // Every session's stats are logged every mStatsIntervalUs, if positive,
+    // as JSON if mStatsAsJSON.
+    int64_t mStatsIntervalUs;
+    int64_t mNextStatsDumpUs;
+    bool mStatsAsJSON;
+
+    void interrupt();
+    void drainInterrupts();
+
+    void processCommands();
+    void acceptConnections(const sp<Session> &session);
+
+    status_t activateSession(const sp<Session> &session);
+    status_t registerSession(const sp<Session> &session);
+    void unregisterSession(const sp<Session> &session);
+    void updatePollEvents(const sp<Session> &session);
+
+    // Writes out the sessions whose pacer has let them go again.
+    void resumePacedSessions();
+
+    int pollTimeoutMs() const;
+    void dumpStats();
+
+    DISALLOW_EVIL_CONSTRUCTORS(Shard);
+};
 ////////////////////////////////////////////////////////////////////////////////
 
-ANetworkSession::NetworkThread::NetworkThread(ANetworkSession *session)
-    : mSession(session) {
+ANetworkSession::NetworkThread::NetworkThread(Shard *shard)
+    : mShard(shard) {
 }
 
 ANetworkSession::NetworkThread::~NetworkThread() {
 }
 
 bool ANetworkSession::NetworkThread::threadLoop() {
-    mSession->threadLoop();
+    mShard->threadLoop();
 
     return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-ANetworkSession::Session::Session(
-        int32_t sessionID,
-        State state,
-        int s,
-        const sp<AMessage> &notify)
-    : mSessionID(sessionID),
-      mState(state),
-      mIsRTSPConnection(false),
-      mSocket(s),
-      mNotify(notify),
-      mSawReceiveFailure(false),
-      mSawSendFailure(false) {
-    if (mState == CONNECTED) {
-        struct sockaddr_in localAddr;
-        socklen_t localAddrLen = sizeof(localAddr);
-
-        int res = getsockname(
-                mSocket, (struct sockaddr *)&localAddr, &localAddrLen);
-        CHECK_GE(res, 0);
+ANetworkSession::SelectPoller::SelectPoller() {
+}
 
-        struct sockaddr_in remoteAddr;
-        socklen_t remoteAddrLen = sizeof(remoteAddr);
+ANetworkSession::SelectPoller::~SelectPoller() {
+}
 
-        res = getpeername(
-                mSocket, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
-        CHECK_GE(res, 0);
+status_t ANetworkSession::SelectPoller::initCheck() const {
+    return OK;
+}
 
-        in_addr_t addr = ntohl(localAddr.sin_addr.s_addr);
-        AString localAddrString = StringPrintf(
-                "%d.%d.%d.%d",
-                (addr >> 24),
-                (addr >> 16) & 0xff,
-                (addr >> 8) & 0xff,
-                addr & 0xff);
+status_t ANetworkSession::SelectPoller::add(
+        int fd, int32_t id, uint32_t events) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return -EINVAL;
+    }
 
-        addr = ntohl(remoteAddr.sin_addr.s_addr);
-        AString remoteAddrString = StringPrintf(
-                "%d.%d.%d.%d",
-                (addr >> 24),
-                (addr >> 16) & 0xff,
-                (addr >> 8) & 0xff,
-                addr & 0xff);
+    Mutex::Autolock autoLock(mLock);
 
-        sp<AMessage> msg = mNotify->dup();
-        msg->setInt32("sessionID", mSessionID);
-        msg->setInt32("reason", kWhatClientConnected);
-        msg->setString("server-ip", localAddrString.c_str());
-        msg->setInt32("server-port", ntohs(localAddr.sin_port));
-        msg->setString("client-ip", remoteAddrString.c_str());
-        msg->setInt32("client-port", ntohs(remoteAddr.sin_port));
-        msg->post();
+    if (mEntries.indexOfKey(fd) >= 0) {
+        return -EEXIST;
     }
-}
 
-ANetworkSession::Session::~Session() {
-    ALOGV("Session %d gone", mSessionID);
+    Entry entry;
+    entry.mID = id;
+    entry.mEvents = events;
+    mEntries.add(fd, entry);
 
-    close(mSocket);
-    mSocket = -1;
+    return OK;
 }
 
-int32_t ANetworkSession::Session::sessionID() const {
-    return mSessionID;
+status_t ANetworkSession::SelectPoller::modify(
+        int fd, int32_t id, uint32_t events) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mEntries.indexOfKey(fd);
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    Entry &entry = mEntries.editValueAt(index);
+    entry.mID = id;
+    entry.mEvents = events;
+
+    return OK;
+}
+
+status_t ANetworkSession::SelectPoller::remove(int fd) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mEntries.indexOfKey(fd);
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    mEntries.removeItemsAt(index);
+
+    return OK;
+}
+
+ssize_t ANetworkSession::SelectPoller::wait(int timeoutMs) {
+    fd_set rs, ws;
+    FD_ZERO(&rs);
+    FD_ZERO(&ws);
+
+    int maxFd = -1;
+
+    KeyedVector<int, Entry> entries;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+        entries = mEntries;
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        int fd = entries.keyAt(i);
+        const Entry &entry = entries.valueAt(i);
+
+        if (entry.mEvents & kEventRead) {
+            FD_SET(fd, &rs);
+        }
+
+        if (entry.mEvents & kEventWrite) {
+            FD_SET(fd, &ws);
+        }
+
+        if (entry.mEvents && fd > maxFd) {
+            maxFd = fd;
+        }
+    }
+
+    mReadyEvents.clear();
+
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+
+    int res = select(
+            maxFd + 1, &rs, &ws, NULL, (timeoutMs < 0) ? NULL : &tv);
+
+    if (res < 0) {
+        return -errno;
+    }
+
+    for (size_t i = 0; res > 0 && i < entries.size(); ++i) {
+        int fd = entries.keyAt(i);
+
+        Entry ready;
+        ready.mID = entries.valueAt(i).mID;
+        ready.mEvents = 0;
+
+        if (FD_ISSET(fd, &rs)) {
+            ready.mEvents |= kEventRead;
+        }
+
+        if (FD_ISSET(fd, &ws)) {
+            ready.mEvents |= kEventWrite;
+        }
+
+        if (ready.mEvents) {
+            mReadyEvents.push(ready);
+            --res;
+        }
+    }
+
+    return mReadyEvents.size();
+}
+
+void ANetworkSession::SelectPoller::eventAt(
+        size_t index, int32_t *id, uint32_t *events) const {
+    const Entry &entry = mReadyEvents.itemAt(index);
+
+    *id = entry.mID;
+    *events = entry.mEvents;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::EPollPoller::EPollPoller()
+    : mFd(epoll_create(kMaxEvents)) {
+    if (mFd < 0) {
+        ALOGE("epoll_create failed (%s)", strerror(errno));
+    } else {
+        fcntl(mFd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+ANetworkSession::EPollPoller::~EPollPoller() {
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+    }
+}
+
+status_t ANetworkSession::EPollPoller::initCheck() const {
+    return mFd >= 0 ? OK : NO_INIT;
+}
+
+status_t ANetworkSession::EPollPoller::control(
+        int op, int fd, int32_t id, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = EPOLLET;
+
+    if (events & kEventRead) {
+        ev.events |= EPOLLIN;
+    }
+
+    if (events & kEventWrite) {
+        ev.events |= EPOLLOUT;
+    }
+
+    ev.data.u32 = (uint32_t)id;
+
+    if (epoll_ctl(mFd, op, fd, &ev) < 0) {
+        return -errno;
+    }
+
+    return OK;
+}
+
+status_t ANetworkSession::EPollPoller::add(
+        int fd, int32_t id, uint32_t events) {
+    return control(EPOLL_CTL_ADD, fd, id, events);
+}
+
+status_t ANetworkSession::EPollPoller::modify(
+        int fd, int32_t id, uint32_t events) {
+    // Re-arming also re-evaluates the current readiness of the socket,
+    // so a newly requested write interest is reported right away.
+    return control(EPOLL_CTL_MOD, fd, id, events);
+}
+
+status_t ANetworkSession::EPollPoller::remove(int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+
+    if (epoll_ctl(mFd, EPOLL_CTL_DEL, fd, &ev) < 0) {
+        return -errno;
+    }
+
+    return OK;
+}
+
+ssize_t ANetworkSession::EPollPoller::wait(int timeoutMs) {
+    int n = epoll_wait(mFd, mEvents, kMaxEvents, timeoutMs);
+
+    if (n < 0) {
+        return -errno;
+    }
+
+    return n;
+}
+
+void ANetworkSession::EPollPoller::eventAt(
+        size_t index, int32_t *id, uint32_t *events) const {
+    CHECK_LT(index, (size_t)kMaxEvents);
+
+    const struct epoll_event &ev = mEvents[index];
+
+    *id = (int32_t)ev.data.u32;
+    *events = 0;
+
+    // Errors and hangups are reported as readiness in both directions,
+    // the subsequent recv/send call will then surface the actual error.
+    if (ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        *events |= kEventRead;
+    }
+
+    if (ev.events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        *events |= kEventWrite;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::BufferPool::BufferPool(size_t bufferSize, size_t maxBuffers)
+    : mBufferSize(bufferSize),
+      mMaxBuffers(maxBuffers),
+      mNextIndex(0),
+      mNumUnpooledOutstanding(0),
+      mHits(0),
+      mMisses(0),
+      mHighWaterMark(0) {
+}
+
+ANetworkSession::BufferPool::~BufferPool() {
+}
+
+sp<ABuffer> ANetworkSession::BufferPool::acquire(size_t size) {
+    if (size > mBufferSize) {
+        ++mMisses;
+
+        sp<ABuffer> buffer = allocateUnpooled(size);
+        updateHighWaterMark(0);
+
+        return buffer;
+    }
+
+    // Resume scanning where the previous search stopped, buffers are
+    // usually returned in the order they were handed out. The buffers
+    // found in use on the way are a lower bound on the number outstanding,
+    // the exact number if none is free.
+    size_t numInUse = 0;
+
+    for (size_t i = 0; i < mBuffers.size(); ++i) {
+        const sp<ABuffer> &buffer = mBuffers.itemAt(mNextIndex);
+
+        if (++mNextIndex == mBuffers.size()) {
+            mNextIndex = 0;
+        }
+
+        if (buffer->getStrongCount() == 1) {
+            ++mHits;
+
+            buffer->setRange(0, size);
+            buffer->setInt32Data(0);
+            buffer->meta()->clear();
+
+            updateHighWaterMark(numInUse + 1);
+
+            return buffer;
+        }
+
+        ++numInUse;
+    }
+
+    ++mMisses;
+
+    sp<ABuffer> buffer;
+
+    if (mBuffers.size() < mMaxBuffers) {
+        buffer = new ABuffer(mBufferSize);
+        mBuffers.push(buffer);
+
+        updateHighWaterMark(numInUse + 1);
+    } else {
+        buffer = allocateUnpooled(mBufferSize);
+
+        updateHighWaterMark(numInUse);
+    }
+
+    buffer->setRange(0, size);
+
+    return buffer;
+}
+
+sp<ABuffer> ANetworkSession::BufferPool::allocateUnpooled(size_t capacity) {
+    return new UnpooledBuffer(this, capacity);
+}
+
+void ANetworkSession::BufferPool::updateHighWaterMark(
+        size_t numPooledOutstanding) {
+    size_t numOutstanding =
+        numPooledOutstanding
+            + android_atomic_acquire_load(&mNumUnpooledOutstanding);
+
+    if (numOutstanding > mHighWaterMark) {
+        mHighWaterMark = numOutstanding;
+    }
+}
+
+size_t ANetworkSession::BufferPool::hits() const {
+    return mHits;
+}
+
+size_t ANetworkSession::BufferPool::misses() const {
+    return mMisses;
+}
+
+size_t ANetworkSession::BufferPool::highWaterMark() const {
+    return mHighWaterMark;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::CommandQueue::CommandQueue()
+    : mHead(&mStub),
+      mTail(&mStub),
+      mStub(Command::kTypeSendRequest, 0) {
+}
+
+ANetworkSession::CommandQueue::~CommandQueue() {
+    Command *cmd;
+    while ((cmd = pop()) != NULL) {
+        delete cmd;
+    }
+}
+
+void ANetworkSession::CommandQueue::push(Command *cmd) {
+    cmd->mNext = NULL;
+
+    // The command's contents have to be visible before it is reachable.
+    __sync_synchronize();
+
+    Command *prev = __sync_lock_test_and_set(&mHead, cmd);
+
+    // Until this store the consumer sees "prev" as the last command.
+    prev->mNext = cmd;
+}
+
+ANetworkSession::Command *ANetworkSession::CommandQueue::pop() {
+    Command *tail = mTail;
+    Command *next = tail->mNext;
+
+    if (tail == &mStub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        mTail = next;
+        tail = next;
+        next = next->mNext;
+    }
+
+    if (next == NULL) {
+        if (tail != mHead) {
+            // A producer swapped mHead but has not linked its command yet.
+            return NULL;
+        }
+
+        // "tail" is the only command left, queue the stub behind it so
+        // that it can be unlinked.
+        push(&mStub);
+
+        next = tail->mNext;
+
+        if (next == NULL) {
+            return NULL;
+        }
+    }
+
+    mTail = next;
+
+    // Pairs with the barrier in push(), the command's contents are read
+    // after observing the link to it.
+    __sync_synchronize();
+
+    return tail;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+status_t ANetworkSession::AddrInfoResolver::resolve(
+        const char *host, struct in_addr *addr) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    struct addrinfo *result;
+    int res = getaddrinfo(host, NULL, &hints, &result);
+
+    if (res != 0) {
+        ALOGE("getaddrinfo('%s') failed (%s)", host, gai_strerror(res));
+        return (res == EAI_SYSTEM) ? -errno : NAME_NOT_FOUND;
+    }
+
+    *addr = ((const struct sockaddr_in *)result->ai_addr)->sin_addr;
+
+    freeaddrinfo(result);
+
+    return OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::ResolverThread::ResolverThread(ANetworkSession *owner)
+    : mOwner(owner) {
+}
+
+ANetworkSession::ResolverThread::~ResolverThread() {
+}
+
+void ANetworkSession::ResolverThread::queueRequest(
+        int32_t sessionID, const char *host, unsigned port,
+        const sp<Resolver> &resolver) {
+    Request request;
+    request.mSessionID = sessionID;
+    request.mHost = host;
+    request.mPort = port;
+    request.mResolver = resolver;
+
+    Mutex::Autolock autoLock(mLock);
+    mRequests.push_back(request);
+    mCondition.signal();
+}
+
+void ANetworkSession::ResolverThread::stop() {
+    requestExit();
+
+    {
+        Mutex::Autolock autoLock(mLock);
+        mCondition.signal();
+    }
+
+    requestExitAndWait();
+}
+
+bool ANetworkSession::ResolverThread::threadLoop() {
+    Request request;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        while (mRequests.empty()) {
+            if (exitPending()) {
+                return false;
+            }
+
+            mCondition.wait(mLock);
+        }
+
+        request = *mRequests.begin();
+        mRequests.erase(mRequests.begin());
+    }
+
+    Command *cmd = new Command(Command::kTypeConnect, request.mSessionID);
+
+    struct sockaddr_in &addr = cmd->mRemoteAddr;
+    memset(addr.sin_zero, 0, sizeof(addr.sin_zero));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(request.mPort);
+
+    cmd->mStatus =
+        request.mResolver->resolve(request.mHost.c_str(), &addr.sin_addr);
+
+    if (cmd->mStatus != OK) {
+        ALOGE("Unable to resolve '%s' for session %d (%d)",
+              request.mHost.c_str(), request.mSessionID, cmd->mStatus);
+    }
+
+    mOwner->pushCommand(cmd);
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::Session::Session(
+        int32_t sessionID,
+        State state,
+        int s,
+        const sp<AMessage> &notify)
+    : mSessionID(sessionID),
+      mState(state),
+      mIsRTSPConnection(false),
+      mSocket(s),
+      mNotify(notify),
+      mSawReceiveFailure(false),
+      mSawSendFailure(false),
+      mResolving(false),
+      mRegisteredPollEvents(0),
+      mDatagramBatchSize(0),
+      mNumOutQueued(0),
+      mLaneInProgress(-1),
+      mOutChunkOffset(0),
+      mMediaLatencyBudgetUs(0ll),
+      mPacingRate(0),
+      mPacingBurstBytes(0),
+      mPacingTokens(0.0),
+      mPacingRefillUs(0ll),
+      mPacingBlocked(false),
+      mPacingBlockedUs(0ll),
+      mPacingResumeUs(0ll),
+#ifdef HAVE_SENDMMSG
+      mUseSendmmsg(true),
+#else
+      mUseSendmmsg(false),
+#endif
+#ifdef UDP_SEGMENT
+      mUseGSO(true) {
+#else
+      mUseGSO(false) {
+#endif
+    if (mState == CONNECTED) {
+        struct sockaddr_in localAddr;
+        socklen_t localAddrLen = sizeof(localAddr);
+
+        int res = getsockname(
+                mSocket, (struct sockaddr *)&localAddr, &localAddrLen);
+        CHECK_GE(res, 0);
+
+        struct sockaddr_in remoteAddr;
+        socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+        res = getpeername(
+                mSocket, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
+        CHECK_GE(res, 0);
+
+        in_addr_t addr = ntohl(localAddr.sin_addr.s_addr);
+        AString localAddrString = StringPrintf(
+                "%d.%d.%d.%d",
+                (addr >> 24),
+                (addr >> 16) & 0xff,
+                (addr >> 8) & 0xff,
+                addr & 0xff);
+
+        addr = ntohl(remoteAddr.sin_addr.s_addr);
+        AString remoteAddrString = StringPrintf(
+                "%d.%d.%d.%d",
+                (addr >> 24),
+                (addr >> 16) & 0xff,
+                (addr >> 8) & 0xff,
+                addr & 0xff);
+
+        sp<AMessage> msg = mNotify->dup();
+        msg->setInt32("sessionID", mSessionID);
+        msg->setInt32("reason", kWhatClientConnected);
+        msg->setString("server-ip", localAddrString.c_str());
+        msg->setInt32("server-port", ntohs(localAddr.sin_port));
+        msg->setString("client-ip", remoteAddrString.c_str());
+        msg->setInt32("client-port", ntohs(remoteAddr.sin_port));
+        msg->post();
+    }
+}
+
+ANetworkSession::Session::~Session() {
+    ALOGV("Session %d gone", mSessionID);
+
+    logStats();
+
+    close(mSocket);
+    mSocket = -1;
+}
+
+int32_t ANetworkSession::Session::sessionID() const {
+    return mSessionID;
+}
+
+int ANetworkSession::Session::socket() const {
+    return mSocket;
+}
+
+void ANetworkSession::Session::setIsRTSPConnection(bool yesno) {
+    mIsRTSPConnection = yesno;
+}
+
+status_t ANetworkSession::Session::setDatagramBatchSize(size_t maxPackets) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    if (maxPackets > kMaxDatagramBatchSize) {
+        maxPackets = kMaxDatagramBatchSize;
+    }
+
+    mDatagramBatchSize = (maxPackets > 1) ? maxPackets : 0;
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::setPacing(
+        int32_t bitsPerSecond, size_t burstBytes) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    mPacingRate = (bitsPerSecond > 0) ? bitsPerSecond : 0;
+    mPacingBurstBytes = (burstBytes > 0) ? burstBytes : kMaxUDPSize;
+
+    // The network thread waits with millisecond resolution, the bucket has
+    // to hold what accrues in the meantime or the rate can't be reached.
+    size_t tickBytes = mPacingRate / 8 * kPacingResolutionUs / 1000000ll;
+    if (mPacingBurstBytes < tickBytes) {
+        mPacingBurstBytes = tickBytes;
+    }
+
+    mPacingTokens = mPacingBurstBytes;
+    mPacingRefillUs = ALooper::GetNowUs();
+    mPacingBlocked = false;
+
+    return OK;
+}
+
+int64_t ANetworkSession::Session::pacingResumeUs() const {
+    return mPacingBlocked ? mPacingResumeUs : -1ll;
+}
+
+void ANetworkSession::Session::resumePacing(int64_t nowUs) {
+    if (!mPacingBlocked) {
+        return;
+    }
+
+    mPacingBlocked = false;
+    mStats.mPacingDelay.add(nowUs - mPacingBlockedUs);
+}
+
+void ANetworkSession::Session::refillPacingTokens(int64_t nowUs) {
+    mPacingTokens += (nowUs - mPacingRefillUs) * (mPacingRate / 8E6);
+    mPacingRefillUs = nowUs;
+
+    if (mPacingTokens > mPacingBurstBytes) {
+        mPacingTokens = mPacingBurstBytes;
+    }
+}
+
+bool ANetworkSession::Session::pacingAllows(double tokens, size_t size) const {
+    // Datagrams larger than the burst size wait for a full bucket instead of
+    // blocking the session forever.
+    return mPacingRate == 0
+        || tokens >= (size < mPacingBurstBytes ? size : mPacingBurstBytes);
+}
+
+void ANetworkSession::Session::blockOnPacer(size_t size, int64_t nowUs) {
+    double needed = (size < mPacingBurstBytes ? size : mPacingBurstBytes);
+    int64_t delayUs = (int64_t)((needed - mPacingTokens) * 8E6 / mPacingRate);
+
+    mPacingBlocked = true;
+    mPacingBlockedUs = nowUs;
+    mPacingResumeUs = nowUs + delayUs;
+    ++mStats.mNumPacingStalls;
+}
+
+bool ANetworkSession::Session::isRTSPConnection() const {
+    return mIsRTSPConnection;
+}
+
+void ANetworkSession::Session::setOptions(const SessionOptions &options) {
+    mOptions = options;
+}
+
+const ANetworkSession::SessionOptions &
+ANetworkSession::Session::options() const {
+    return mOptions;
+}
+
+void ANetworkSession::Session::setResolving(bool resolving) {
+    mResolving = resolving;
+}
+
+void ANetworkSession::Session::completeConnect(
+        status_t err, const struct sockaddr_in &addr) {
+    mResolving = false;
+
+    if (err == OK) {
+        in_addr_t x = ntohl(addr.sin_addr.s_addr);
+        ALOGI("connecting socket %d to %d.%d.%d.%d:%d",
+              mSocket,
+              (x >> 24),
+              (x >> 16) & 0xff,
+              (x >> 8) & 0xff,
+              x & 0xff,
+              ntohs(addr.sin_port));
+
+        int res = connect(
+                mSocket, (const struct sockaddr *)&addr, sizeof(addr));
+
+        if (res < 0 && !(mState == CONNECTING && errno == EINPROGRESS)) {
+            err = -errno;
+        }
+    }
+
+    if (err != OK) {
+        notifyError(false /* send */, err, "Unable to connect.");
+        mSawSendFailure = true;
+        return;
+    }
+
+    if (mState == DATAGRAM) {
+        // Stream sockets report kWhatConnected from writeMore() once the
+        // connection is established.
+        notify(kWhatConnected);
+    }
+}
+
+sp<AMessage> ANetworkSession::Session::getNotificationMessage() const {
+    return mNotify;
+}
+
+bool ANetworkSession::Session::isRTSPServer() const {
+    return mState == LISTENING_RTSP;
+}
+
+bool ANetworkSession::Session::isTCPDatagramServer() const {
+    return mState == LISTENING_TCP_DGRAMS;
+}
+
+bool ANetworkSession::Session::wantsToRead() {
+    return !mSawReceiveFailure && mState != CONNECTING;
+}
+
+bool ANetworkSession::Session::wantsToWrite() {
+    return !mSawSendFailure
+        && !mResolving
+        && (mState == CONNECTING
+            || (mState == CONNECTED && mNumOutQueued > 0)
+            || (mState == DATAGRAM && mNumOutQueued > 0 && !mPacingBlocked));
+}
+
+uint32_t ANetworkSession::Session::pollEvents() {
+    uint32_t events = 0;
+
+    if (wantsToRead()) {
+        events |= Poller::kEventRead;
+    }
+
+    if (wantsToWrite()) {
+        events |= Poller::kEventWrite;
+    }
+
+    return events;
+}
+
+uint32_t ANetworkSession::Session::registeredPollEvents() const {
+    return mRegisteredPollEvents;
+}
+
+void ANetworkSession::Session::setRegisteredPollEvents(uint32_t events) {
+    mRegisteredPollEvents = events;
+}
+
+sp<ABuffer> ANetworkSession::Session::acquireBuffer(size_t size) {
+    if (mBufferPool == NULL) {
+        mBufferPool = new BufferPool(kMaxUDPSize, kMaxPooledBuffers);
+    }
+
+    return mBufferPool->acquire(size);
+}
+
+// Ancillary data buffer large enough for an SCM_TIMESTAMPNS message.
+union ANetworkSession::ReceiveControlBuffer {
+    struct cmsghdr mAlign;
+    uint8_t mData[CMSG_SPACE(sizeof(struct timespec))];
+};
+
+static int64_t GetRealTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+// SO_TIMESTAMPNS stamps packets with CLOCK_REALTIME when the kernel received
+// them. Maps such a timestamp found in "msg" onto the ALooper::GetNowUs() time
+// base, given both clocks sampled after the packet was dequeued. "delayUs" is
+// the time the packet spent queued before reaching user space.
+static bool GetKernelArrivalTime(
+        const struct msghdr *msg, int64_t nowUs, int64_t nowRealTimeUs,
+        int64_t *arrivalTimeUs, int64_t *delayUs) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg != NULL; cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET
+                || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+            continue;
+        }
+
+        const struct timespec *ts = (const struct timespec *)CMSG_DATA(cmsg);
+        int64_t kernelTimeUs =
+            (int64_t)ts->tv_sec * 1000000ll + ts->tv_nsec / 1000;
+
+        // Don't trust timestamps ahead of now, e.g. after a clock change.
+        *delayUs = nowRealTimeUs - kernelTimeUs;
+        if (*delayUs < 0ll) {
+            *delayUs = 0ll;
+        }
+
+        *arrivalTimeUs = nowUs - *delayUs;
+
+        return true;
+    }
+
+    return false;
+}
+
+void ANetworkSession::Session::setArrivalTime(
+        const sp<ABuffer> &buffer, const struct msghdr *msg,
+        int64_t nowUs, int64_t nowRealTimeUs) const {
+    sp<AMessage> meta = buffer->meta();
+
+    int64_t arrivalTimeUs, delayUs;
+    if (mOptions.mReceiveTimestamps
+            && GetKernelArrivalTime(
+                msg, nowUs, nowRealTimeUs, &arrivalTimeUs, &delayUs)) {
+        meta->setInt64("arrivalTimeUs", arrivalTimeUs);
+        meta->setInt64("receiveDelayUs", delayUs);
+    } else {
+        meta->setInt64("arrivalTimeUs", nowUs);
+    }
+}
+
+#ifdef HAVE_RECVMMSG
+status_t ANetworkSession::Session::readDatagramBatch() {
+    MultiMessage msgs[kMaxDatagramBatchSize];
+    struct iovec iovs[kMaxDatagramBatchSize];
+    struct sockaddr_in remoteAddrs[kMaxDatagramBatchSize];
+    ReceiveControlBuffer controls[kMaxDatagramBatchSize];
+    sp<ABuffer> buffers[kMaxDatagramBatchSize];
+
+    status_t err = OK;
+    for (;;) {
+        for (size_t i = 0; i < mDatagramBatchSize; ++i) {
+            if (buffers[i] == NULL) {
+                buffers[i] = acquireBuffer(kMaxUDPSize);
+            }
+
+            iovs[i].iov_base = buffers[i]->data();
+            iovs[i].iov_len = buffers[i]->capacity();
+
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].mHeader.msg_name = &remoteAddrs[i];
+            msgs[i].mHeader.msg_namelen = sizeof(remoteAddrs[i]);
+            msgs[i].mHeader.msg_iov = &iovs[i];
+            msgs[i].mHeader.msg_iovlen = 1;
+
+            if (mOptions.mReceiveTimestamps) {
+                msgs[i].mHeader.msg_control = controls[i].mData;
+                msgs[i].mHeader.msg_controllen = sizeof(controls[i].mData);
+            }
+        }
+
+        int n;
+        do {
+            n = syscall(
+                    __NR_recvmmsg, mSocket, msgs, mDatagramBatchSize, 0, NULL);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            err = -errno;
+            break;
+        }
+
+        if (n == 0) {
+            err = -ECONNRESET;
+            break;
+        }
+
+        int64_t nowUs = ALooper::GetNowUs();
+        int64_t nowRealTimeUs =
+            mOptions.mReceiveTimestamps ? GetRealTimeUs() : 0ll;
+
+        sp<DatagramBatch> batch = new DatagramBatch;
+        batch->mPackets.setCapacity(n);
+
+        for (int i = 0; i < n; ++i) {
+            if (msgs[i].mLength == 0) {
+                continue;
+            }
+
+            sp<ABuffer> buf = buffers[i];
+            buffers[i].clear();
+
+            buf->setRange(0, msgs[i].mLength);
+
+            ++mStats.mPacketsIn;
+            mStats.mBytesIn += msgs[i].mLength;
+
+            setArrivalTime(buf, &msgs[i].mHeader, nowUs, nowRealTimeUs);
+
+            sp<AMessage> meta = buf->meta();
+            meta->setInt32("fromIP", ntohl(remoteAddrs[i].sin_addr.s_addr));
+            meta->setInt32("fromPort", ntohs(remoteAddrs[i].sin_port));
+
+            batch->mPackets.push(buf);
+        }
+
+        if (batch->mPackets.isEmpty()) {
+            continue;
+        }
+
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("sessionID", mSessionID);
+        notify->setInt32("reason", kWhatDatagramBatch);
+        notify->setObject("packets", batch);
+        notify->post();
+    }
+
+    return err;
+}
+#endif
+
+status_t ANetworkSession::Session::readMore() {
+#ifdef HAVE_RECVMMSG
+    if (mState == DATAGRAM && mDatagramBatchSize > 0) {
+        status_t err = readDatagramBatch();
+
+        if (err == -ENOSYS) {
+            ALOGW("recvmmsg is not supported, falling back to "
+                  "per-packet receive on session %d", mSessionID);
+
+            mDatagramBatchSize = 0;
+        } else {
+            if (err == -EAGAIN) {
+                err = OK;
+            }
+
+            if (err != OK) {
+                notifyError(false /* send */, err, "Recvmmsg failed.");
+                mSawReceiveFailure = true;
+            }
+
+            return err;
+        }
+    }
+#endif
+
+    if (mState == DATAGRAM) {
+        status_t err;
+        do {
+            sp<ABuffer> buf = acquireBuffer(kMaxUDPSize);
+
+            struct sockaddr_in remoteAddr;
+
+            struct iovec iov;
+            iov.iov_base = buf->data();
+            iov.iov_len = buf->capacity();
+
+            ReceiveControlBuffer control;
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &remoteAddr;
+            msg.msg_namelen = sizeof(remoteAddr);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+
+            if (mOptions.mReceiveTimestamps) {
+                msg.msg_control = control.mData;
+                msg.msg_controllen = sizeof(control.mData);
+            }
+
+            ssize_t n;
+            do {
+                n = recvmsg(mSocket, &msg, 0);
+            } while (n < 0 && errno == EINTR);
+
+            err = OK;
+            if (n < 0) {
+                err = -errno;
+            } else if (n == 0) {
+                err = -ECONNRESET;
+            } else {
+                buf->setRange(0, n);
+
+                ++mStats.mPacketsIn;
+                mStats.mBytesIn += n;
+
+                setArrivalTime(
+                        buf, &msg, ALooper::GetNowUs(),
+                        mOptions.mReceiveTimestamps ? GetRealTimeUs() : 0ll);
+
+                sp<AMessage> notify = mNotify->dup();
+                notify->setInt32("sessionID", mSessionID);
+                notify->setInt32("reason", kWhatDatagram);
+
+                uint32_t ip = ntohl(remoteAddr.sin_addr.s_addr);
+                notify->setString(
+                        "fromAddr",
+                        StringPrintf(
+                            "%u.%u.%u.%u",
+                            ip >> 24,
+                            (ip >> 16) & 0xff,
+                            (ip >> 8) & 0xff,
+                            ip & 0xff).c_str());
+
+                notify->setInt32("fromPort", ntohs(remoteAddr.sin_port));
+
+                notify->setBuffer("data", buf);
+                notify->post();
+            }
+        } while (err == OK);
+
+        if (err == -EAGAIN) {
+            err = OK;
+        }
+
+        if (err != OK) {
+            notifyError(false /* send */, err, "Recvmsg failed.");
+            mSawReceiveFailure = true;
+        }
+
+        return err;
+    }
+
+    // Drain the socket completely, the poller may be edge-triggered. Data
+    // is framed after every recv to keep the receive buffer small.
+    status_t err = OK;
+    for (;;) {
+        makeRoomForRead();
+
+        size_t avail =
+            mInBuffer->capacity() - mInBuffer->offset() - mInBuffer->size();
+
+        ssize_t n;
+        do {
+            n = recv(mSocket,
+                     mInBuffer->data() + mInBuffer->size(), avail, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+#if 0
+            ALOGI("in:");
+            hexdump(mInBuffer->data() + mInBuffer->size(), n);
+#endif
+
+            mInBuffer->setRange(mInBuffer->offset(), mInBuffer->size() + n);
+
+            mStats.mBytesIn += n;
+        } else if (n < 0) {
+            err = -errno;
+        } else {
+            err = -ECONNRESET;
+        }
+
+        if (err == -EAGAIN) {
+            err = OK;
+            break;
+        }
+
+        parseStreamData(err != OK /* noMoreData */);
+
+        if (err != OK) {
+            break;
+        }
+    }
+
+    if (err != OK) {
+        notifyError(false /* send */, err, "Recv failed.");
+        mSawReceiveFailure = true;
+    }
+
+    return err;
+}
+
+void ANetworkSession::Session::makeRoomForRead() {
+    if (mInBuffer == NULL) {
+        mInBuffer = new ABuffer(kStreamBufferSize);
+        mInBuffer->setRange(0, 0);
+        return;
+    }
+
+    size_t used = mInBuffer->offset() + mInBuffer->size();
+
+    if (mInBuffer->capacity() - used >= kMinStreamReadSize) {
+        return;
+    }
+
+    size_t pending = mInBuffer->size();
+    size_t capacity = mInBuffer->capacity();
+
+    if (pending + kMinStreamReadSize > capacity) {
+        // A single frame larger than the buffer is being received.
+        capacity = pending + kMinStreamReadSize;
+        if (capacity < 2 * mInBuffer->capacity()) {
+            capacity = 2 * mInBuffer->capacity();
+        }
+    } else if (mInBuffer->getStrongCount() == 1) {
+        // No slices refer to the consumed bytes anymore, move the
+        // (usually small) unparsed tail to the front.
+        memmove(mInBuffer->base(), mInBuffer->data(), pending);
+        mInBuffer->setRange(0, pending);
+        return;
+    }
+
+    // Slices handed to clients still point into the current buffer, which
+    // is released once they are gone. Continue in a fresh one.
+    sp<ABuffer> buffer = new ABuffer(capacity);
+    memcpy(buffer->data(), mInBuffer->data(), pending);
+    buffer->setRange(0, pending);
+
+    mInBuffer = buffer;
+}
+
+void ANetworkSession::Session::consumeInBuffer(size_t size) {
+    CHECK_LE(size, mInBuffer->size());
+
+    mInBuffer->setRange(mInBuffer->offset() + size, mInBuffer->size() - size);
+}
+
+sp<ABuffer> ANetworkSession::Session::sliceInBuffer(
+        size_t offset, size_t size) {
+    return new BufferSlice(mInBuffer, mInBuffer->offset() + offset, size);
+}
+
+void ANetworkSession::Session::parseStreamData(bool noMoreData) {
+    if (!mIsRTSPConnection) {
+        // TCP stream carrying 16-bit length-prefixed datagrams.
+
+        while (mInBuffer->size() >= 2) {
+            size_t packetSize = U16_AT(mInBuffer->data());
+
+            if (mInBuffer->size() < packetSize + 2) {
+                break;
+            }
+
+            sp<ABuffer> packet = sliceInBuffer(2, packetSize);
+
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("sessionID", mSessionID);
+            notify->setInt32("reason", kWhatDatagram);
+            notify->setBuffer("data", packet);
+            notify->post();
+
+            ++mStats.mPacketsIn;
+
+            consumeInBuffer(packetSize + 2);
+        }
+
+        return;
+    }
+
+    for (;;) {
+        const uint8_t *data = mInBuffer->data();
+        size_t size = mInBuffer->size();
+        size_t length;
+
+        if (size > 0 && data[0] == '$') {
+            if (size < 4) {
+                break;
+            }
+
+            length = U16_AT(&data[2]);
+
+            if (size < 4 + length) {
+                break;
+            }
+
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("sessionID", mSessionID);
+            notify->setInt32("reason", kWhatBinaryData);
+            notify->setInt32("channel", data[1]);
+
+            sp<ABuffer> packet = sliceInBuffer(4, length);
+
+            int64_t nowUs = ALooper::GetNowUs();
+            packet->meta()->setInt64("arrivalTimeUs", nowUs);
+
+            notify->setBuffer("data", packet);
+            notify->post();
+
+            ++mStats.mPacketsIn;
+
+            consumeInBuffer(4 + length);
+            continue;
+        }
+
+        sp<ParsedMessage> msg =
+            ParsedMessage::Parse(
+                    (const char *)data, size, noMoreData, &length);
+
+        if (msg == NULL) {
+            break;
+        }
+
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("sessionID", mSessionID);
+        notify->setInt32("reason", kWhatData);
+        notify->setObject("data", msg);
+        notify->post();
+
+        ++mStats.mPacketsIn;
+
+#if 1
+        // XXX The (old) dongle sends the wrong content length header on a
+        // SET_PARAMETER request that signals a "wfd_idr_request".
+        // (17 instead of 19).
+        const char *content = msg->getContent();
+        if (content
+                && !memcmp(content, "wfd_idr_request\r\n", 17)
+                && length >= 19
+                && length + 2 <= size
+                && data[length] == '\r'
+                && data[length + 1] == '\n') {
+            length += 2;
+        }
+#endif
+
+        consumeInBuffer(length);
+
+        if (noMoreData) {
+            break;
+        }
+    }
+}
+
+void ANetworkSession::RTPTimeRewriter::onEgress(
+        int32_t sessionID, const sp<ABuffer> &datagram) {
+    uint8_t *data = datagram->data();
+    if (datagram->size() >= 8 && data[0] == 0x80 && (data[1] & 0x7f) == 33) {
+        int64_t nowUs = ALooper::GetNowUs();
+
+        uint32_t prevRtpTime = U32_AT(&data[4]);
+
+        // 90kHz time scale
+        uint32_t rtpTime = (nowUs * 9ll) / 100ll;
+        int32_t diffTime = (int32_t)rtpTime - (int32_t)prevRtpTime;
+
+        ALOGV("correcting rtpTime by %.0f ms", diffTime / 90.0);
+
+        data[4] = rtpTime >> 24;
+        data[5] = (rtpTime >> 16) & 0xff;
+        data[6] = (rtpTime >> 8) & 0xff;
+        data[7] = rtpTime & 0xff;
+    }
+}
+
+void ANetworkSession::Session::runEgressHook(OutBuffer *entry) {
+    if (entry->mEgressHookRan) {
+        return;
+    }
+
+    entry->mEgressHookRan = true;
+
+    if (mOptions.mEgressHook != NULL) {
+        mOptions.mEgressHook->onEgress(mSessionID, entry->mBuffer);
+    }
+}
+
+#ifdef HAVE_SENDMMSG
+status_t ANetworkSession::Session::writeDatagramBatch(List<OutBuffer> *queue) {
+    MultiMessage msgs[kMaxDatagramBatchSize];
+    struct iovec iovs[kMaxSendIovecs];
+    size_t numSegments[kMaxDatagramBatchSize];
+
+#ifdef UDP_SEGMENT
+    union {
+        char mData[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr mAlign;
+    } controls[kMaxDatagramBatchSize];
+#endif
+
+    status_t err = OK;
+    while (err == OK && !queue->empty()) {
+        size_t numMsgs = 0;
+        size_t numIovecs = 0;
+
+        // Bytes the pacer lets through in this round.
+        double tokens = 0.0;
+        if (mPacingRate > 0) {
+            refillPacingTokens(ALooper::GetNowUs());
+            tokens = mPacingTokens;
+        }
+
+        List<OutBuffer>::iterator it = queue->begin();
+        while (it != queue->end()
+                && numMsgs < kMaxDatagramBatchSize
+                && numIovecs < kMaxSendIovecs
+                && pacingAllows(tokens, it->mBuffer->size())) {
+            MultiMessage *msg = &msgs[numMsgs];
+            memset(msg, 0, sizeof(*msg));
+            msg->mHeader.msg_iov = &iovs[numIovecs];
+
+            // With GSO a run of equally sized datagrams (the last one may
+            // be shorter) goes out as a single message that the kernel
+            // splits into segments of "segmentSize" bytes.
+            size_t segmentSize = it->mBuffer->size();
+            size_t totalSize = 0;
+            size_t count = 0;
+
+            for (;;) {
+                OutBuffer &entry = *it++;
+                runEgressHook(&entry);
+
+                const sp<ABuffer> &datagram = entry.mBuffer;
+
+                iovs[numIovecs].iov_base = datagram->data();
+                iovs[numIovecs].iov_len = datagram->size();
+                ++numIovecs;
+
+                totalSize += datagram->size();
+                ++count;
+
+                tokens -= datagram->size();
+
+#ifdef UDP_SEGMENT
+                if (mUseGSO
+                        && datagram->size() == segmentSize
+                        && segmentSize > 0
+                        && it != queue->end()
+                        && numIovecs < kMaxSendIovecs
+                        && count < kMaxGSOSegments
+                        && it->mBuffer->size() > 0
+                        && it->mBuffer->size() <= segmentSize
+                        && totalSize + it->mBuffer->size() <= kMaxGSOSize
+                        && pacingAllows(tokens, it->mBuffer->size())) {
+                    continue;
+                }
+#endif
+                break;
+            }
+
+            msg->mHeader.msg_iovlen = count;
+
+#ifdef UDP_SEGMENT
+            if (count > 1) {
+                msg->mHeader.msg_control = controls[numMsgs].mData;
+                msg->mHeader.msg_controllen = sizeof(controls[numMsgs].mData);
+
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg->mHeader);
+                cmsg->cmsg_level = IPPROTO_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t *)CMSG_DATA(cmsg) = segmentSize;
+            }
+#endif
+
+            numSegments[numMsgs++] = count;
+        }
+
+        if (numMsgs == 0) {
+            // The pacer holds back even the first datagram.
+            blockOnPacer(queue->begin()->mBuffer->size(), mPacingRefillUs);
+            break;
+        }
+
+        int n;
+        do {
+            n = syscall(__NR_sendmmsg, mSocket, msgs, numMsgs, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            err = -errno;
+
+            if (mUseGSO
+                    && numSegments[0] > 1
+                    && (err == -EIO || err == -EINVAL || err == -ENOPROTOOPT)) {
+                ALOGW("UDP GSO unavailable (%s), disabling it on session %d",
+                      strerror(-err), mSessionID);
+
+                mUseGSO = false;
+                err = OK;
+            }
+            continue;
+        }
+
+        // Only the first "n" messages made it, the next attempt either
+        // blocks or reports the error that stopped this one.
+        int64_t nowUs = ALooper::GetNowUs();
+        for (int i = 0; i < n; ++i) {
+            for (size_t j = 0; j < numSegments[i]; ++j) {
+                dequeueOut(queue, nowUs);
+            }
+        }
+    }
+
+    return err;
+}
+#endif
+
+status_t ANetworkSession::Session::writeDatagrams(List<OutBuffer> *queue) {
+    status_t err = OK;
+
+#ifdef HAVE_SENDMMSG
+    if (mUseSendmmsg) {
+        err = writeDatagramBatch(queue);
+
+        if (err == -ENOSYS) {
+            ALOGW("sendmmsg is not supported, falling back to "
+                  "per-packet send on session %d", mSessionID);
+
+            mUseSendmmsg = false;
+            err = OK;
+        }
+    }
+#endif
+
+    while (!mUseSendmmsg && err == OK && !queue->empty()) {
+        OutBuffer &entry = *queue->begin();
+        const sp<ABuffer> &datagram = entry.mBuffer;
+
+        if (mPacingRate > 0) {
+            int64_t nowUs = ALooper::GetNowUs();
+            refillPacingTokens(nowUs);
+
+            if (!pacingAllows(mPacingTokens, datagram->size())) {
+                blockOnPacer(datagram->size(), nowUs);
+                break;
+            }
+        }
+
+        runEgressHook(&entry);
+
+        int n;
+        do {
+            n = send(mSocket, datagram->data(), datagram->size(), 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+            dequeueOut(queue, ALooper::GetNowUs());
+        } else if (n < 0) {
+            err = -errno;
+        } else if (n == 0) {
+            err = -ECONNRESET;
+        }
+    }
+
+    return err;
+}
+
+status_t ANetworkSession::Session::writeMore() {
+    if (mState == DATAGRAM) {
+        dropStaleMedia(ALooper::GetNowUs());
+
+        status_t err = OK;
+
+        // Every datagram is a request of its own, so control datagrams can
+        // always go out ahead of queued media.
+        for (size_t lane = 0; lane < kNumLanes; ++lane) {
+            err = writeDatagrams(&mOutQueues[lane]);
+
+            if (err != OK || mPacingBlocked || !mOutQueues[lane].empty()) {
+                break;
+            }
+        }
+
+        if (err == -EAGAIN) {
+            ++mStats.mNumEAGAIN;
+            ALOGV("%d datagrams remain queued.", mNumOutQueued);
+            err = OK;
+        }
+
+        if (err != OK) {
+            notifyError(true /* send */, err, "Send datagram failed.");
+            mSawSendFailure = true;
+        }
+
+        return err;
+    }
+
+    if (mState == CONNECTING) {
+        int err;
+        socklen_t optionLen = sizeof(err);
+        CHECK_EQ(getsockopt(mSocket, SOL_SOCKET, SO_ERROR, &err, &optionLen), 0);
+        CHECK_EQ(optionLen, (socklen_t)sizeof(err));
+
+        if (err != 0) {
+            notifyError(kWhatError, -err, "Connection failed");
+            mSawSendFailure = true;
+
+            return -err;
+        }
+
+        mState = CONNECTED;
+        notify(kWhatConnected);
+
+        return OK;
+    }
+
+    CHECK_EQ(mState, CONNECTED);
+
+    dropStaleMedia(ALooper::GetNowUs());
+
+    status_t err = OK;
+
+    while (mNumOutQueued > 0) {
+        struct iovec iovs[kMaxStreamIovecs];
+        size_t numIovecs = 0;
+
+        // Gather the chunks in the order consumeOutChunks() retires them.
+        List<OutBuffer>::iterator its[kNumLanes];
+        for (size_t i = 0; i < kNumLanes; ++i) {
+            its[i] = mOutQueues[i].begin();
+        }
+
+        ssize_t lane = mLaneInProgress;
+        size_t offset = mOutChunkOffset;
+        while (numIovecs < kMaxStreamIovecs) {
+            for (size_t i = 0; lane < 0 && i < kNumLanes; ++i) {
+                if (its[i] != mOutQueues[i].end()) {
+                    lane = i;
+                }
+            }
+
+            if (lane < 0) {
+                break;
+            }
+
+            const OutBuffer &entry = *its[lane]++;
+
+            iovs[numIovecs].iov_base = entry.mBuffer->data() + offset;
+            iovs[numIovecs].iov_len = entry.mBuffer->size() - offset;
+            ++numIovecs;
+
+            offset = 0;
+
+            if (entry.mEndOfRequest) {
+                lane = -1;
+            }
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iovs;
+        msg.msg_iovlen = numIovecs;
+
+        ssize_t n;
+        do {
+            n = sendmsg(mSocket, &msg, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+#if 0
+            ALOGI("out:");
+            hexdump(iovs[0].iov_base, iovs[0].iov_len);
+#endif
+
+            consumeOutChunks(n);
+            continue;
+        }
+
+        if (n < 0) {
+            err = -errno;
+        } else {
+            err = -ECONNRESET;
+        }
+        break;
+    }
+
+    if (err == -EAGAIN) {
+        ++mStats.mNumEAGAIN;
+        err = OK;
+    }
+
+    if (err != OK) {
+        notifyError(true /* send */, err, "Send failed.");
+        mSawSendFailure = true;
+    }
+
+    return err;
+}
+
+status_t ANetworkSession::Session::sendRequest(
+        const sp<ABuffer> *buffers, size_t count, int64_t queuedUs,
+        Priority priority) {
+    CHECK(mState == CONNECTED || mState == DATAGRAM);
+
+    List<OutBuffer> *queue = &mOutQueues[priority];
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size += buffers[i]->size();
+    }
+
+    // Media frames are only told apart if they may have to be dropped,
+    // looking at the meta data of every buffer isn't free.
+    int64_t timeUs = -1ll;
+    if (priority == kPriorityMedia
+            && (mMediaLatencyBudgetUs > 0ll
+                || mOptions.mMediaDeadlineUs > 0ll)) {
+        for (size_t i = 0; i < count; ++i) {
+            int64_t bufferTimeUs;
+            if (buffers[i]->meta()->findInt64("timeUs", &bufferTimeUs)) {
+                timeUs = bufferTimeUs;
+            }
+        }
+    }
+
+    if (mState == DATAGRAM) {
+        if (count == 1) {
+            queueOut(
+                    queue, buffers[0], queuedUs, timeUs,
+                    true /* endOfRequest */);
+        } else {
+            // A datagram has to be contiguous.
+            sp<ABuffer> datagram = new ABuffer(size);
+            ++mStats.mNumSendAllocations;
+
+            size_t offset = 0;
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(datagram->data() + offset,
+                       buffers[i]->data(),
+                       buffers[i]->size());
+
+                offset += buffers[i]->size();
+            }
+
+            queueOut(
+                    queue, datagram, queuedUs, timeUs,
+                    true /* endOfRequest */);
+        }
+    } else {
+        // Only the last non-empty chunk ends the request.
+        ssize_t last = count - 1;
+        while (last >= 0 && buffers[last]->size() == 0) {
+            --last;
+        }
+
+        if (!mIsRTSPConnection) {
+            CHECK_LE(size, 65535u);
+
+            sp<ABuffer> prefix = new ABuffer(2);
+            prefix->data()[0] = size >> 8;
+            prefix->data()[1] = size & 0xff;
+            ++mStats.mNumSendAllocations;
+
+            queueOut(
+                    queue, prefix, queuedUs, timeUs,
+                    last < 0 /* endOfRequest */);
+        }
+
+        for (ssize_t i = 0; i <= last; ++i) {
+            if (buffers[i]->size() > 0) {
+                queueOut(queue, buffers[i], queuedUs, timeUs, i == last);
+            }
+        }
+    }
+
+    if (priority == kPriorityMedia) {
+        // The socket may not have been writable for a while.
+        dropStaleMedia(ALooper::GetNowUs());
+    }
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::setMediaLatencyBudget(int64_t budgetUs) {
+    if (budgetUs < 0ll) {
+        return -EINVAL;
+    }
+
+    mMediaLatencyBudgetUs = budgetUs;
+
+    return OK;
+}
+
+bool ANetworkSession::Session::isStale(
+        const OutBuffer &entry, int64_t nowUs) const {
+    if (mMediaLatencyBudgetUs > 0ll
+            && nowUs - entry.mQueuedUs > mMediaLatencyBudgetUs) {
+        return true;
+    }
+
+    return mOptions.mMediaDeadlineUs > 0ll
+        && entry.mTimeUs >= 0ll
+        && nowUs > entry.mTimeUs + mOptions.mMediaDeadlineUs;
+}
+
+void ANetworkSession::Session::dropStaleMedia(int64_t nowUs) {
+    if (mMediaLatencyBudgetUs == 0ll && mOptions.mMediaDeadlineUs == 0ll) {
+        return;
+    }
+
+    List<OutBuffer> *queue = &mOutQueues[kPriorityMedia];
+    List<OutBuffer>::iterator it = queue->begin();
+
+    int64_t lastTimeUs = -1ll;
+
+    if (mLaneInProgress == kPriorityMedia) {
+        // Part of this request is on the wire already, it has to be
+        // completed.
+        for (;;) {
+            const OutBuffer &entry = *it++;
+
+            if (entry.mEndOfRequest) {
+                lastTimeUs = entry.mTimeUs;
+                break;
+            }
+        }
+    }
+
+    size_t numFrames = 0;
+    size_t numRequests = 0;
+    size_t numBytes = 0;
+    int64_t droppedTimeUs = -1ll;
+
+    // Requests are queued in order, the oldest ones come first. Once a
+    // request is dropped the remainder of its frame is worthless, so the
+    // following requests of the same frame go as well.
+    while (it != queue->end()) {
+        int64_t timeUs = it->mTimeUs;
+        bool sameFrame = (droppedTimeUs >= 0ll && timeUs == droppedTimeUs);
+
+        if (!sameFrame && !isStale(*it, nowUs)) {
+            break;
+        }
+
+        if (!sameFrame && (timeUs < 0ll || timeUs != lastTimeUs)) {
+            // Frames that have been partially sent already aren't counted.
+            ++numFrames;
+        }
+
+        ++numRequests;
+
+        for (;;) {
+            bool endOfRequest = it->mEndOfRequest;
+
+            numBytes += it->mBuffer->size();
+
+            it = queue->erase(it);
+            --mNumOutQueued;
+
+            if (endOfRequest) {
+                break;
+            }
+        }
+
+        droppedTimeUs = timeUs;
+    }
+
+    if (numRequests == 0) {
+        return;
+    }
+
+    mStats.mNumMediaDropped += numRequests;
+    mStats.mMediaBytesDropped += numBytes;
+    mStats.mNumFramesDropped += numFrames;
+
+    if (mOptions.mNotifyMediaDropped) {
+        sp<AMessage> msg = mNotify->dup();
+        msg->setInt32("sessionID", mSessionID);
+        msg->setInt32("reason", kWhatMediaDropped);
+        msg->setInt32("frames", numFrames);
+        msg->setInt32("requests", numRequests);
+        msg->setInt64("bytes", numBytes);
+
+        if (droppedTimeUs >= 0ll) {
+            msg->setInt64("timeUs", droppedTimeUs);
+        }
+
+        msg->post();
+    }
+}
+
+void ANetworkSession::Session::consumeOutChunks(size_t size) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    while (size > 0) {
+        if (mLaneInProgress < 0) {
+            // At a request boundary, the highest priority lane goes next.
+            for (size_t i = 0; mLaneInProgress < 0 && i < kNumLanes; ++i) {
+                if (!mOutQueues[i].empty()) {
+                    mLaneInProgress = i;
+                }
+            }
+        }
+
+        CHECK_GE(mLaneInProgress, 0);
+
+        List<OutBuffer> *queue = &mOutQueues[mLaneInProgress];
+
+        const OutBuffer &entry = *queue->begin();
+        size_t remaining = entry.mBuffer->size() - mOutChunkOffset;
+
+        if (size < remaining) {
+            mOutChunkOffset += size;
+            break;
+        }
+
+        size -= remaining;
+
+        if (entry.mEndOfRequest) {
+            mLaneInProgress = -1;
+        }
+
+        dequeueOut(queue, nowUs);
+        mOutChunkOffset = 0;
+    }
+}
+
+void ANetworkSession::Session::queueOut(
+        List<OutBuffer> *queue, const sp<ABuffer> &buffer, int64_t queuedUs,
+        int64_t timeUs, bool endOfRequest) {
+    OutBuffer entry;
+    entry.mBuffer = buffer;
+    entry.mQueuedUs = queuedUs;
+    entry.mTimeUs = timeUs;
+    entry.mEndOfRequest = endOfRequest;
+    entry.mEgressHookRan = false;
+    queue->push_back(entry);
+
+    if (++mNumOutQueued > mStats.mQueueHighWaterMark) {
+        mStats.mQueueHighWaterMark = mNumOutQueued;
+    }
+}
+
+void ANetworkSession::Session::dequeueOut(
+        List<OutBuffer> *queue, int64_t nowUs) {
+    const OutBuffer &entry = *queue->begin();
+
+    ++mStats.mPacketsOut;
+    mStats.mBytesOut += entry.mBuffer->size();
+    mStats.mQueueDwell.add(nowUs - entry.mQueuedUs);
+
+    if (mPacingRate > 0) {
+        mPacingTokens -= entry.mBuffer->size();
+    }
+
+    queue->erase(queue->begin());
+    --mNumOutQueued;
+}
+
+void ANetworkSession::Session::notifyError(
+        bool send, status_t err, const char *detail) {
+    if (send) {
+        ++mStats.mNumSendErrors;
+    } else {
+        ++mStats.mNumReceiveErrors;
+    }
+
+    sp<AMessage> msg = mNotify->dup();
+    msg->setInt32("sessionID", mSessionID);
+    msg->setInt32("reason", kWhatError);
+    msg->setInt32("send", send);
+    msg->setInt32("err", err);
+    msg->setString("detail", detail);
+    msg->post();
+}
+
+void ANetworkSession::Session::notify(NotificationReason reason) {
+    sp<AMessage> msg = mNotify->dup();
+    msg->setInt32("sessionID", mSessionID);
+    msg->setInt32("reason", reason);
+    msg->post();
+}
+
+void ANetworkSession::Session::recordDispatchLatency(int64_t latencyUs) {
+    mStats.mDispatchLatency.add(latencyUs);
+}
+
+// static
+void ANetworkSession::Session::AddStatsEntry(
+        Vector<StatsEntry> *entries, const char *name, int64_t value) {
+    StatsEntry entry;
+    entry.mName = name;
+    entry.mValue = value;
+    entries->push(entry);
+}
+
+void ANetworkSession::Session::collectStats(
+        Vector<StatsEntry> *entries) const {
+    AddStatsEntry(entries, "packetsIn", mStats.mPacketsIn);
+    AddStatsEntry(entries, "bytesIn", mStats.mBytesIn);
+    AddStatsEntry(entries, "packetsOut", mStats.mPacketsOut);
+    AddStatsEntry(entries, "bytesOut", mStats.mBytesOut);
+    AddStatsEntry(entries, "eagain", mStats.mNumEAGAIN);
+    AddStatsEntry(entries, "receiveErrors", mStats.mNumReceiveErrors);
+    AddStatsEntry(entries, "sendErrors", mStats.mNumSendErrors);
+    AddStatsEntry(entries, "queued", mNumOutQueued);
+    AddStatsEntry(entries, "queueHighWaterMark", mStats.mQueueHighWaterMark);
+    AddStatsEntry(entries, "mediaDropped", mStats.mNumMediaDropped);
+    AddStatsEntry(entries, "mediaBytesDropped", mStats.mMediaBytesDropped);
+    AddStatsEntry(entries, "framesDropped", mStats.mNumFramesDropped);
+    AddStatsEntry(entries, "sendAllocations", mStats.mNumSendAllocations);
+
+    const LatencyHistogram &dwell = mStats.mQueueDwell;
+    AddStatsEntry(entries, "queueDwellP50Us", dwell.percentileUs(50));
+    AddStatsEntry(entries, "queueDwellP99Us", dwell.percentileUs(99));
+    AddStatsEntry(entries, "queueDwellP999Us", dwell.percentileUs(99.9));
+    AddStatsEntry(entries, "queueDwellMaxUs", dwell.maxUs());
+
+    const LatencyHistogram &dispatch = mStats.mDispatchLatency;
+    AddStatsEntry(entries, "dispatchP50Us", dispatch.percentileUs(50));
+    AddStatsEntry(entries, "dispatchP99Us", dispatch.percentileUs(99));
+    AddStatsEntry(entries, "dispatchP999Us", dispatch.percentileUs(99.9));
+    AddStatsEntry(entries, "dispatchMaxUs", dispatch.maxUs());
+
+    if (mPacingRate > 0) {
+        const LatencyHistogram &pacing = mStats.mPacingDelay;
+        AddStatsEntry(entries, "pacingRate", mPacingRate);
+        AddStatsEntry(entries, "pacingStalls", mStats.mNumPacingStalls);
+        AddStatsEntry(entries, "pacingDelayP50Us", pacing.percentileUs(50));
+        AddStatsEntry(entries, "pacingDelayP99Us", pacing.percentileUs(99));
+        AddStatsEntry(entries, "pacingDelayMaxUs", pacing.maxUs());
+    }
+
+    if (mBufferPool != NULL) {
+        AddStatsEntry(entries, "poolHits", mBufferPool->hits());
+        AddStatsEntry(entries, "poolMisses", mBufferPool->misses());
+        AddStatsEntry(
+                entries, "poolHighWaterMark", mBufferPool->highWaterMark());
+    }
+}
+
+void ANetworkSession::Session::getStats(const sp<AMessage> &msg) const {
+    Vector<StatsEntry> entries;
+    collectStats(&entries);
+
+    msg->setInt32("sessionID", mSessionID);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const StatsEntry &entry = entries.itemAt(i);
+        msg->setInt64(entry.mName, entry.mValue);
+    }
+}
+
+AString ANetworkSession::Session::statsAsJSON() const {
+    Vector<StatsEntry> entries;
+    collectStats(&entries);
+
+    AString json = StringPrintf("{\"sessionID\":%d", mSessionID);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const StatsEntry &entry = entries.itemAt(i);
+        json.append(StringPrintf(",\"%s\":%lld", entry.mName, entry.mValue));
+    }
+
+    json.append("}");
+
+    return json;
+}
+
+int64_t ANetworkSession::Session::numPackets() const {
+    return mStats.mPacketsIn + mStats.mPacketsOut;
+}
+
+void ANetworkSession::Session::logStats() const {
+    ALOGI("Session %d: in %lld pkts/%lld bytes, out %lld pkts/%lld bytes, "
+          "%lld EAGAIN, %lld/%lld recv/send errors, "
+          "queued %d (max %d), %lld media requests dropped, "
+          "dwell p50 %lld p99 %lld max %lld us, "
+          "dispatch p50 %lld p99 %lld max %lld us",
+          mSessionID,
+          mStats.mPacketsIn, mStats.mBytesIn,
+          mStats.mPacketsOut, mStats.mBytesOut,
+          mStats.mNumEAGAIN,
+          mStats.mNumReceiveErrors, mStats.mNumSendErrors,
+          mNumOutQueued, mStats.mQueueHighWaterMark,
+          mStats.mNumMediaDropped,
+          mStats.mQueueDwell.percentileUs(50),
+          mStats.mQueueDwell.percentileUs(99),
+          mStats.mQueueDwell.maxUs(),
+          mStats.mDispatchLatency.percentileUs(50),
+          mStats.mDispatchLatency.percentileUs(99),
+          mStats.mDispatchLatency.maxUs());
+
+    if (mStats.mNumPacingStalls > 0) {
+        ALOGI("Session %d pacer: %lld stalls, delay p50 %lld p99 %lld "
+              "max %lld us",
+              mSessionID,
+              mStats.mNumPacingStalls,
+              mStats.mPacingDelay.percentileUs(50),
+              mStats.mPacingDelay.percentileUs(99),
+              mStats.mPacingDelay.maxUs());
+    }
+
+    if (mBufferPool != NULL) {
+        ALOGI("Session %d buffer pool: %d hits, %d misses, high-water mark %d",
+              mSessionID,
+              mBufferPool->hits(),
+              mBufferPool->misses(),
+              mBufferPool->highWaterMark());
+    }
+}
+
+ANetworkSession::Session::Stats::Stats()
+    : mPacketsIn(0ll),
+      mBytesIn(0ll),
+      mPacketsOut(0ll),
+      mBytesOut(0ll),
+      mNumEAGAIN(0ll),
+      mNumReceiveErrors(0ll),
+      mNumSendErrors(0ll),
+      mQueueHighWaterMark(0),
+      mNumPacingStalls(0ll),
+      mNumMediaDropped(0ll),
+      mMediaBytesDropped(0ll),
+      mNumFramesDropped(0ll),
+      mNumSendAllocations(0ll) {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::LatencyHistogram::LatencyHistogram()
+    : mCount(0),
+      mMaxUs(0ll) {
+    memset(mBuckets, 0, sizeof(mBuckets));
+}
+
+void ANetworkSession::LatencyHistogram::add(int64_t latencyUs) {
+    size_t index = 0;
+    if (latencyUs > 0ll) {
+        // Number of significant bits.
+        index = 64 - __builtin_clzll((uint64_t)latencyUs);
+
+        if (index >= kNumBuckets) {
+            index = kNumBuckets - 1;
+        }
+    } else {
+        latencyUs = 0ll;
+    }
+
+    ++mBuckets[index];
+    ++mCount;
+
+    if (latencyUs > mMaxUs) {
+        mMaxUs = latencyUs;
+    }
+}
+
+int64_t ANetworkSession::LatencyHistogram::percentileUs(
+        double percent) const {
+    if (mCount == 0) {
+        return 0ll;
+    }
+
+    // Rank of the sample sought, rounded up.
+    uint64_t rank = (uint64_t)ceil(mCount * percent / 100.0);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+        seen += mBuckets[i];
+
+        if (seen >= rank) {
+            int64_t upperUs = (i == 0) ? 0ll : (1ll << i) - 1;
+            return (upperUs < mMaxUs) ? upperUs : mMaxUs;
+        }
+    }
+
+    return mMaxUs;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::Shard::Shard(ANetworkSession *owner, size_t index)
+    : mOwner(owner),
+      mIndex(index),
+      mCommands(new CommandQueue),
+      mWakeupFd(-1),
+      mWakeupPending(0),
+      mNumWakeupsIssued(0),
+      mNumWakeupsCoalesced(0),
+      mStatsIntervalUs(0ll),
+      mNextStatsDumpUs(0ll),
+      mStatsAsJSON(false) {
+}
+
+ANetworkSession::Shard::~Shard() {
+    stop();
+}
+
+status_t ANetworkSession::Shard::start() {
+    if (mThread != NULL) {
+        return INVALID_OPERATION;
+    }
+
+    mWakeupFd = eventfd(0, 0);
+    if (mWakeupFd < 0) {
+        return -errno;
+    }
+
+    mWakeupPending = 0;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("persist.sys.wfd.statsinterval", val, NULL)) {
+        mStatsIntervalUs = atoi(val) * 1000000ll;
+    }
+
+    mStatsAsJSON =
+        property_get("persist.sys.wfd.statsformat", val, NULL)
+            && !strcmp("json", val);
+
+    if (mStatsIntervalUs > 0ll) {
+        mNextStatsDumpUs = ALooper::GetNowUs() + mStatsIntervalUs;
+    }
+
+    status_t err = MakeSocketNonBlocking(mWakeupFd);
+
+    if (err == OK) {
+        mPoller = CreatePoller();
+
+        err = mPoller->add(mWakeupFd, Poller::kWakeupID, Poller::kEventRead);
+
+        // Sessions added while the network thread was stopped are still
+        // queued as commands and registered once it runs.
+        for (size_t i = 0; err == OK && i < mSessions.size(); ++i) {
+            err = registerSession(mSessions.valueAt(i));
+        }
+
+        if (err != OK) {
+            mPoller.clear();
+        }
+    }
+
+    if (err == OK) {
+        mThread = new NetworkThread(this);
+
+        AString name = "ANetworkSession";
+        if (mOwner->mShards.size() > 1) {
+            name.append(StringPrintf("/%d", mIndex));
+        }
+
+        err = mThread->run(name.c_str(), ANDROID_PRIORITY_AUDIO);
+    }
+
+    if (err != OK) {
+        mThread.clear();
+        mPoller.clear();
+
+        close(mWakeupFd);
+        mWakeupFd = -1;
+
+        return err;
+    }
+
+    return OK;
 }
 
-int ANetworkSession::Session::socket() const {
-    return mSocket;
+status_t ANetworkSession::Shard::stop() {
+    if (mThread == NULL) {
+        return INVALID_OPERATION;
+    }
+
+    mThread->requestExit();
+    interrupt();
+    mThread->requestExitAndWait();
+
+    mThread.clear();
+
+    mPoller.clear();
+
+    for (size_t i = 0; i < mSessions.size(); ++i) {
+        mSessions.valueAt(i)->setRegisteredPollEvents(0);
+    }
+
+    close(mWakeupFd);
+    mWakeupFd = -1;
+
+    ALOGI("shard %d: %d wakeups issued, %d coalesced",
+          mIndex, mNumWakeupsIssued, mNumWakeupsCoalesced);
+
+    return OK;
 }
 
-void ANetworkSession::Session::setIsRTSPConnection(bool yesno) {
-    mIsRTSPConnection = yesno;
-}
+status_t ANetworkSession::Shard::registerSession(
+        const sp<Session> &session) {
+    if (mPoller == NULL) {
+        // Registered once the network thread is started.
+        return OK;
+    }
 
-sp<AMessage> ANetworkSession::Session::getNotificationMessage() const {
-    return mNotify;
-}
+    uint32_t events = session->pollEvents();
 
-bool ANetworkSession::Session::isRTSPServer() const {
-    return mState == LISTENING_RTSP;
-}
+    status_t err = mPoller->add(
+            session->socket(), session->sessionID(), events);
 
-bool ANetworkSession::Session::isTCPDatagramServer() const {
-    return mState == LISTENING_TCP_DGRAMS;
-}
+    if (err != OK) {
+        ALOGE("Unable to register socket %d of session %d (%s)",
+              session->socket(), session->sessionID(), strerror(-err));
+        return err;
+    }
 
-bool ANetworkSession::Session::wantsToRead() {
-    return !mSawReceiveFailure && mState != CONNECTING;
+    session->setRegisteredPollEvents(events);
+
+    return OK;
 }
 
-bool ANetworkSession::Session::wantsToWrite() {
-    return !mSawSendFailure
-        && (mState == CONNECTING
-            || (mState == CONNECTED && !mOutBuffer.empty())
-            || (mState == DATAGRAM && !mOutDatagrams.empty()));
+void ANetworkSession::Shard::unregisterSession(
+        const sp<Session> &session) {
+    if (mPoller == NULL) {
+        return;
+    }
+
+    status_t err = mPoller->remove(session->socket());
+
+    if (err != OK) {
+        ALOGW("Unable to unregister socket %d of session %d (%s)",
+              session->socket(), session->sessionID(), strerror(-err));
+    }
 }
 
-status_t ANetworkSession::Session::readMore() {
-    if (mState == DATAGRAM) {
-        status_t err;
-        do {
-            sp<ABuffer> buf = new ABuffer(kMaxUDPSize);
+void ANetworkSession::Shard::updatePollEvents(
+        const sp<Session> &session) {
+    if (mPoller == NULL) {
+        return;
+    }
 
-            struct sockaddr_in remoteAddr;
-            socklen_t remoteAddrLen = sizeof(remoteAddr);
+    uint32_t events = session->pollEvents();
 
-            ssize_t n;
-            do {
-                n = recvfrom(
-                        mSocket, buf->data(), buf->capacity(), 0,
-                        (struct sockaddr *)&remoteAddr, &remoteAddrLen);
-            } while (n < 0 && errno == EINTR);
+    if (events == session->registeredPollEvents()) {
+        return;
+    }
 
-            err = OK;
-            if (n < 0) {
-                err = -errno;
-            } else if (n == 0) {
-                err = -ECONNRESET;
-            } else {
-                buf->setRange(0, n);
+    status_t err = mPoller->modify(
+            session->socket(), session->sessionID(), events);
 
-                int64_t nowUs = ALooper::GetNowUs();
-                buf->meta()->setInt64("arrivalTimeUs", nowUs);
+    if (err != OK) {
+        ALOGW("Unable to update socket %d of session %d (%s)",
+              session->socket(), session->sessionID(), strerror(-err));
+        return;
+    }
 
-                sp<AMessage> notify = mNotify->dup();
-                notify->setInt32("sessionID", mSessionID);
-                notify->setInt32("reason", kWhatDatagram);
+    session->setRegisteredPollEvents(events);
+}
 
-                uint32_t ip = ntohl(remoteAddr.sin_addr.s_addr);
-                notify->setString(
-                        "fromAddr",
-                        StringPrintf(
-                            "%u.%u.%u.%u",
-                            ip >> 24,
-                            (ip >> 16) & 0xff,
-                            (ip >> 8) & 0xff,
-                            ip & 0xff).c_str());
+void ANetworkSession::Shard::pushCommand(Command *cmd) {
+    mCommands->push(cmd);
+    interrupt();
+}
 
-                notify->setInt32("fromPort", ntohs(remoteAddr.sin_port));
+void ANetworkSession::Shard::interrupt() {
+    if (android_atomic_cmpxchg(0, 1, &mWakeupPending)) {
+        // The network thread has not picked up the previous wakeup yet and
+        // will see whatever prompted this one.
+        android_atomic_inc(&mNumWakeupsCoalesced);
+        return;
+    }
 
-                notify->setBuffer("data", buf);
-                notify->post();
-            }
-        } while (err == OK);
+    android_atomic_inc(&mNumWakeupsIssued);
 
-        if (err == -EAGAIN) {
-            err = OK;
-        }
+    const uint64_t one = 1;
 
-        if (err != OK) {
-            notifyError(false /* send */, err, "Recvfrom failed.");
-            mSawReceiveFailure = true;
-        }
+    ssize_t n;
+    do {
+        n = write(mWakeupFd, &one, sizeof(one));
+    } while (n < 0 && errno == EINTR);
 
-        return err;
+    if (n < 0) {
+        ALOGW("Error writing to eventfd (%s)", strerror(errno));
     }
+}
 
-    char tmp[512];
+void ANetworkSession::Shard::drainInterrupts() {
+    // A single read resets the eventfd counter, however many wakeups
+    // were accumulated.
+    uint64_t count;
     ssize_t n;
     do {
-        n = recv(mSocket, tmp, sizeof(tmp), 0);
+        n = read(mWakeupFd, &count, sizeof(count));
     } while (n < 0 && errno == EINTR);
 
-    status_t err = OK;
+    if (n < 0 && errno != EAGAIN) {
+        ALOGW("Error reading from eventfd (%s)", strerror(errno));
+    }
 
-    if (n > 0) {
-        mInBuffer.append(tmp, n);
+    // Only clear the flag once the eventfd has been drained. Clearing it
+    // first would let a wakeup written in between be swallowed by the read
+    // above while the flag stays set, after which no interrupt() would ever
+    // write to the eventfd again. Commands queued by an interrupt() that
+    // skipped its write because the flag was still set are picked up by
+    // the processCommands() at the top of the next iteration.
+    android_atomic_release_store(0, &mWakeupPending);
+}
 
-#if 0
-        ALOGI("in:");
-        hexdump(tmp, n);
-#endif
-    } else if (n < 0) {
-        err = -errno;
-    } else {
-        err = -ECONNRESET;
+status_t ANetworkSession::Shard::activateSession(
+        const sp<Session> &session) {
+    status_t err = registerSession(session);
+
+    if (err != OK) {
+        return err;
     }
 
-    if (!mIsRTSPConnection) {
-        // TCP stream carrying 16-bit length-prefixed datagrams.
+    mSessions.add(session->sessionID(), session);
+
+    return OK;
+}
 
-        while (mInBuffer.size() >= 2) {
-            size_t packetSize = U16_AT((const uint8_t *)mInBuffer.c_str());
+void ANetworkSession::Shard::processCommands() {
+    Command *cmd;
+    while ((cmd = mCommands->pop()) != NULL) {
+        if (cmd->mType == Command::kTypeAddSession) {
+            status_t err = activateSession(cmd->mSession);
 
-            if (mInBuffer.size() < packetSize + 2) {
-                break;
+            if (err != OK) {
+                cmd->mSession->notifyError(
+                        false /* send */, err, "Unable to register socket.");
             }
 
-            sp<ABuffer> packet = new ABuffer(packetSize);
-            memcpy(packet->data(), mInBuffer.c_str() + 2, packetSize);
+            delete cmd;
+            continue;
+        }
 
-            sp<AMessage> notify = mNotify->dup();
-            notify->setInt32("sessionID", mSessionID);
-            notify->setInt32("reason", kWhatDatagram);
-            notify->setBuffer("data", packet);
-            notify->post();
+        ssize_t index = mSessions.indexOfKey(cmd->mSessionID);
+
+        if (index < 0) {
+            ALOGW("Dropping command %d for unknown session %d",
+                  cmd->mType, cmd->mSessionID);
+
+            if (cmd->mReply != NULL) {
+                cmd->mReply->setInt32("err", -ENOENT);
+                cmd->mReply->post();
+            }
 
-            mInBuffer.erase(0, packetSize + 2);
+            delete cmd;
+            continue;
         }
-    } else {
-        for (;;) {
-            size_t length;
 
-            if (mInBuffer.size() > 0 && mInBuffer.c_str()[0] == '$') {
-                if (mInBuffer.size() < 4) {
-                    break;
-                }
+        sp<Session> session = mSessions.valueAt(index);
 
-                length = U16_AT((const uint8_t *)mInBuffer.c_str() + 2);
+        switch (cmd->mType) {
+            case Command::kTypeDestroySession:
+            {
+                unregisterSession(session);
+                mSessions.removeItemsAt(index);
+                break;
+            }
 
-                if (mInBuffer.size() < 4 + length) {
+            case Command::kTypeSendInterleavedData:
+            {
+                if (!session->isRTSPConnection()) {
+                    ALOGW("Session %d is not an RTSP connection, dropping "
+                          "interleaved data", cmd->mSessionID);
                     break;
                 }
 
-                sp<AMessage> notify = mNotify->dup();
-                notify->setInt32("sessionID", mSessionID);
-                notify->setInt32("reason", kWhatBinaryData);
-                notify->setInt32("channel", mInBuffer.c_str()[1]);
-
-                sp<ABuffer> data = new ABuffer(length);
-                memcpy(data->data(), mInBuffer.c_str() + 4, length);
+                session->sendRequest(
+                        cmd->mBuffers, cmd->mNumBuffers, cmd->mQueuedUs,
+                        cmd->mPriority);
+                updatePollEvents(session);
+                break;
+            }
 
-                int64_t nowUs = ALooper::GetNowUs();
-                data->meta()->setInt64("arrivalTimeUs", nowUs);
+            case Command::kTypeSendRequest:
+            {
+                Priority priority = cmd->mPriority;
 
-                notify->setBuffer("data", data);
-                notify->post();
+                if (cmd->mPriorityBySession) {
+                    // Raw requests are RTSP messages on RTSP connections and
+                    // media, e.g. RTP/RTCP packets, on everything else.
+                    priority = session->isRTSPConnection()
+                        ? kPriorityControl : kPriorityMedia;
+                }
 
-                mInBuffer.erase(0, 4 + length);
-                continue;
+                session->sendRequest(
+                        cmd->mBuffers, cmd->mNumBuffers, cmd->mQueuedUs,
+                        priority);
+                updatePollEvents(session);
+                break;
             }
 
-            sp<ParsedMessage> msg =
-                ParsedMessage::Parse(
-                        mInBuffer.c_str(), mInBuffer.size(), err != OK, &length);
+            case Command::kTypeSetDatagramBatchSize:
+            {
+                session->setDatagramBatchSize(cmd->mDatagramBatchSize);
+                break;
+            }
 
-            if (msg == NULL) {
+            case Command::kTypeConnect:
+            {
+                session->completeConnect(cmd->mStatus, cmd->mRemoteAddr);
+                updatePollEvents(session);
                 break;
             }
 
-            sp<AMessage> notify = mNotify->dup();
-            notify->setInt32("sessionID", mSessionID);
-            notify->setInt32("reason", kWhatData);
-            notify->setObject("data", msg);
-            notify->post();
+            case Command::kTypeSetPacing:
+            {
+                status_t err = session->setPacing(
+                        cmd->mPacingRate, cmd->mPacingBurstBytes);
 
-#if 1
-            // XXX The (old) dongle sends the wrong content length header on a
-            // SET_PARAMETER request that signals a "wfd_idr_request".
-            // (17 instead of 19).
-            const char *content = msg->getContent();
-            if (content
-                    && !memcmp(content, "wfd_idr_request\r\n", 17)
-                    && length >= 19
-                    && mInBuffer.c_str()[length] == '\r'
-                    && mInBuffer.c_str()[length + 1] == '\n') {
-                length += 2;
+                if (err != OK) {
+                    ALOGW("Unable to set up pacing of session %d (%s)",
+                          cmd->mSessionID, strerror(-err));
+                }
+
+                updatePollEvents(session);
+                break;
             }
-#endif
 
-            mInBuffer.erase(0, length);
+            case Command::kTypeSetMediaLatencyBudget:
+            {
+                session->setMediaLatencyBudget(cmd->mLatencyBudgetUs);
+                updatePollEvents(session);
+                break;
+            }
 
-            if (err != OK) {
+            case Command::kTypeGetStats:
+            {
+                session->getStats(cmd->mReply);
+                cmd->mReply->setInt32("err", OK);
+                cmd->mReply->post();
                 break;
             }
+
+            default:
+                TRESPASS();
         }
-    }
 
-    if (err != OK) {
-        notifyError(false /* send */, err, "Recv failed.");
-        mSawReceiveFailure = true;
+        delete cmd;
     }
-
-    return err;
 }
 
-status_t ANetworkSession::Session::writeMore() {
-    if (mState == DATAGRAM) {
-        CHECK(!mOutDatagrams.empty());
+void ANetworkSession::Shard::acceptConnections(const sp<Session> &session) {
+    int s = session->socket();
 
-        status_t err;
-        do {
-            const sp<ABuffer> &datagram = *mOutDatagrams.begin();
+    for (;;) {
+        struct sockaddr_in remoteAddr;
+        socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+        int clientSocket = accept(
+                s, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
 
-            uint8_t *data = datagram->data();
-            if (data[0] == 0x80 && (data[1] & 0x7f) == 33) {
-                int64_t nowUs = ALooper::GetNowUs();
+        if (clientSocket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-                uint32_t prevRtpTime = U32_AT(&data[4]);
+            if (errno != EAGAIN) {
+                ALOGE("accept returned error %d (%s)",
+                      errno, strerror(errno));
+            }
+            break;
+        }
 
-                // 90kHz time scale
-                uint32_t rtpTime = (nowUs * 9ll) / 100ll;
-                int32_t diffTime = (int32_t)rtpTime - (int32_t)prevRtpTime;
+        status_t err = ApplySessionOptions(
+                clientSocket, false /* isDatagram */, session->options());
 
-                ALOGV("correcting rtpTime by %.0f ms", diffTime / 90.0);
+        if (err == OK) {
+            err = MakeSocketNonBlocking(clientSocket);
+        }
 
-                data[4] = rtpTime >> 24;
-                data[5] = (rtpTime >> 16) & 0xff;
-                data[6] = (rtpTime >> 8) & 0xff;
-                data[7] = rtpTime & 0xff;
-            }
+        if (err != OK) {
+            ALOGE("Unable to set up client socket, "
+                  "failed w/ error %d (%s)",
+                  err, strerror(-err));
 
-            int n;
-            do {
-                n = send(mSocket, datagram->data(), datagram->size(), 0);
-            } while (n < 0 && errno == EINTR);
+            close(clientSocket);
+            clientSocket = -1;
+            continue;
+        }
 
-            err = OK;
+        in_addr_t addr = ntohl(remoteAddr.sin_addr.s_addr);
 
-            if (n > 0) {
-                mOutDatagrams.erase(mOutDatagrams.begin());
-            } else if (n < 0) {
-                err = -errno;
-            } else if (n == 0) {
-                err = -ECONNRESET;
-            }
-        } while (err == OK && !mOutDatagrams.empty());
+        ALOGI("incoming connection from %d.%d.%d.%d:%d "
+              "(socket %d)",
+              (addr >> 24),
+              (addr >> 16) & 0xff,
+              (addr >> 8) & 0xff,
+              addr & 0xff,
+              ntohs(remoteAddr.sin_port),
+              clientSocket);
 
-        if (err == -EAGAIN) {
-            if (!mOutDatagrams.empty()) {
-                ALOGI("%d datagrams remain queued.", mOutDatagrams.size());
-            }
-            err = OK;
+        sp<Session> clientSession;
+
+        {
+            // Held until the session is listed so that a client reacting
+            // to kWhatClientConnected can destroy it.
+            Mutex::Autolock autoLock(mOwner->mLock);
+
+            // Client sessions stay on their listener's shard.
+            clientSession =
+                new Session(
+                        mOwner->allocateSessionID(session->sessionID()),
+                        Session::CONNECTED,
+                        clientSocket,
+                        session->getNotificationMessage());
+
+            clientSession->setIsRTSPConnection(session->isRTSPServer());
+            clientSession->setOptions(session->options());
+
+            mOwner->mSessions.add(clientSession->sessionID(), clientSession);
         }
 
-        if (err != OK) {
-            notifyError(true /* send */, err, "Send datagram failed.");
-            mSawSendFailure = true;
+        // Commands referring to the new session are processed on this
+        // thread, i.e. only after it is active.
+        if (activateSession(clientSession) != OK) {
+            Mutex::Autolock autoLock(mOwner->mLock);
+            mOwner->mSessions.removeItem(clientSession->sessionID());
+            continue;
         }
 
-        return err;
+        ALOGI("added clientSession %d", clientSession->sessionID());
     }
+}
 
-    if (mState == CONNECTING) {
-        int err;
-        socklen_t optionLen = sizeof(err);
-        CHECK_EQ(getsockopt(mSocket, SOL_SOCKET, SO_ERROR, &err, &optionLen), 0);
-        CHECK_EQ(optionLen, (socklen_t)sizeof(err));
+void ANetworkSession::Shard::threadLoop() {
+    // Also picks up whatever was queued before the thread was started.
+    processCommands();
 
-        if (err != 0) {
-            notifyError(kWhatError, -err, "Connection failed");
-            mSawSendFailure = true;
+    ssize_t res = mPoller->wait(pollTimeoutMs());
 
-            return -err;
+    if (res < 0) {
+        if (res == -EINTR) {
+            return;
         }
 
-        mState = CONNECTED;
-        notify(kWhatConnected);
-
-        return OK;
+        ALOGE("poll failed w/ error %d (%s)", -res, strerror(-res));
+        return;
     }
 
-    CHECK_EQ(mState, CONNECTED);
-    CHECK(!mOutBuffer.empty());
+    int64_t readyUs = ALooper::GetNowUs();
 
-    ssize_t n;
-    do {
-        n = send(mSocket, mOutBuffer.c_str(), mOutBuffer.size(), 0);
-    } while (n < 0 && errno == EINTR);
+    // mSessions and the sessions' I/O state are only ever touched on this
+    // thread, no lock is held while reading or writing.
+    for (ssize_t i = 0; i < res; ++i) {
+        int32_t id;
+        uint32_t events;
+        mPoller->eventAt(i, &id, &events);
 
-    status_t err = OK;
+        if (id == Poller::kWakeupID) {
+            drainInterrupts();
+            continue;
+        }
 
-    if (n > 0) {
-#if 0
-        ALOGI("out:");
-        hexdump(mOutBuffer.c_str(), n);
-#endif
+        ssize_t index = mSessions.indexOfKey(id);
 
-        mOutBuffer.erase(0, n);
-    } else if (n < 0) {
-        err = -errno;
-    } else if (n == 0) {
-        err = -ECONNRESET;
+        if (index < 0) {
+            // The session was destroyed in the meantime.
+            continue;
+        }
+
+        sp<Session> session = mSessions.valueAt(index);
+
+        session->recordDispatchLatency(ALooper::GetNowUs() - readyUs);
+
+        int s = session->socket();
+
+        if ((events & Poller::kEventRead) && session->wantsToRead()) {
+            if (session->isRTSPServer() || session->isTCPDatagramServer()) {
+                acceptConnections(session);
+            } else {
+                status_t err = session->readMore();
+                if (err != OK) {
+                    ALOGE("readMore on socket %d failed w/ error %d (%s)",
+                          s, err, strerror(-err));
+                }
+            }
+        }
+
+        if ((events & Poller::kEventWrite) && session->wantsToWrite()) {
+            status_t err = session->writeMore();
+            if (err != OK) {
+                ALOGE("writeMore on socket %d failed w/ error %d (%s)",
+                      s, err, strerror(-err));
+            }
+        }
+
+        updatePollEvents(session);
     }
 
-    if (err != OK) {
-        notifyError(true /* send */, err, "Send failed.");
-        mSawSendFailure = true;
+    resumePacedSessions();
+
+    if (mStatsIntervalUs > 0ll && ALooper::GetNowUs() >= mNextStatsDumpUs) {
+        dumpStats();
     }
+}
 
-    return err;
+void ANetworkSession::Shard::resumePacedSessions() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    for (size_t i = 0; i < mSessions.size(); ++i) {
+        sp<Session> session = mSessions.valueAt(i);
+
+        int64_t resumeUs = session->pacingResumeUs();
+        if (resumeUs < 0ll || resumeUs > nowUs) {
+            continue;
+        }
+
+        session->resumePacing(nowUs);
+
+        if (session->wantsToWrite()) {
+            status_t err = session->writeMore();
+            if (err != OK) {
+                ALOGE("writeMore on socket %d failed w/ error %d (%s)",
+                      session->socket(), err, strerror(-err));
+            }
+        }
+
+        updatePollEvents(session);
+    }
 }
 
-status_t ANetworkSession::Session::sendRequest(const void *data, ssize_t size) {
-    CHECK(mState == CONNECTED || mState == DATAGRAM);
+int ANetworkSession::Shard::pollTimeoutMs() const {
+    int64_t wakeupUs = -1ll;
 
-    if (mState == DATAGRAM) {
-        CHECK_GE(size, 0);
+    if (mStatsIntervalUs > 0ll) {
+        wakeupUs = mNextStatsDumpUs;
+    }
 
-        sp<ABuffer> datagram = new ABuffer(size);
-        memcpy(datagram->data(), data, size);
+    for (size_t i = 0; i < mSessions.size(); ++i) {
+        int64_t resumeUs = mSessions.valueAt(i)->pacingResumeUs();
 
-        mOutDatagrams.push_back(datagram);
-        return OK;
+        if (resumeUs >= 0ll && (wakeupUs < 0ll || resumeUs < wakeupUs)) {
+            wakeupUs = resumeUs;
+        }
+    }
+
+    if (wakeupUs < 0ll) {
+        return -1;
     }
 
-    if (mState == CONNECTED && !mIsRTSPConnection) {
-        CHECK_LE(size, 65535);
+    int64_t delayUs = wakeupUs - ALooper::GetNowUs();
+    if (delayUs <= 0ll) {
+        return 0;
+    }
+
+    // Round up, waking up early would only spin.
+    return (delayUs + 999ll) / 1000ll;
+}
+
+void ANetworkSession::Shard::dumpStats() {
+    int64_t numPackets = 0ll;
 
-        uint8_t prefix[2];
-        prefix[0] = size >> 8;
-        prefix[1] = size & 0xff;
+    for (size_t i = 0; i < mSessions.size(); ++i) {
+        const sp<Session> &session = mSessions.valueAt(i);
 
-        mOutBuffer.append((const char *)prefix, sizeof(prefix));
+        if (mStatsAsJSON) {
+            ALOGI("%s", session->statsAsJSON().c_str());
+        } else {
+            session->logStats();
+        }
+
+        numPackets += session->numPackets();
     }
 
-    mOutBuffer.append(
-            (const char *)data,
-            (size >= 0) ? size : strlen((const char *)data));
+    // Called on the shard's own thread.
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    int64_t cpuUs = (int64_t)ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+
+    if (mStatsAsJSON) {
+        ALOGI("{\"shard\":%d,\"sessions\":%d,\"packets\":%lld,"
+              "\"cpuUs\":%lld,\"wakeupsIssued\":%d,"
+              "\"wakeupsCoalesced\":%d}",
+              mIndex, mSessions.size(), numPackets, cpuUs,
+              mNumWakeupsIssued, mNumWakeupsCoalesced);
+    } else {
+        ALOGI("shard %d: %d sessions, %lld packets, %lld us cpu, "
+              "%d wakeups issued, %d coalesced",
+              mIndex, mSessions.size(), numPackets, cpuUs,
+              mNumWakeupsIssued, mNumWakeupsCoalesced);
+    }
 
-    return OK;
+    mNextStatsDumpUs = ALooper::GetNowUs() + mStatsIntervalUs;
 }
 
-void ANetworkSession::Session::notifyError(
-        bool send, status_t err, const char *detail) {
-    sp<AMessage> msg = mNotify->dup();
-    msg->setInt32("sessionID", mSessionID);
-    msg->setInt32("reason", kWhatError);
-    msg->setInt32("send", send);
-    msg->setInt32("err", err);
-    msg->setString("detail", detail);
-    msg->post();
-}
+////////////////////////////////////////////////////////////////////////////////
 
-void ANetworkSession::Session::notify(NotificationReason reason) {
-    sp<AMessage> msg = mNotify->dup();
-    msg->setInt32("sessionID", mSessionID);
-    msg->setInt32("reason", reason);
-    msg->post();
+ANetworkSession::SessionOptions::SessionOptions()
+    : mReceiveBufferSize(-1),
+      mSendBufferSize(-1),
+      mTypeOfService(-1),
+      mPriority(-1),
+      mBusyPollUs(0),
+      mNoDelay(false),
+      mMTUDiscover(-1),
+      mReceiveTimestamps(false),
+      mAffinitySessionID(0),
+      mMediaDeadlineUs(0ll),
+      mNotifyMediaDropped(false) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-ANetworkSession::ANetworkSession()
-    : mNextSessionID(1) {
-    mPipeFd[0] = mPipeFd[1] = -1;
+ANetworkSession::ANetworkSession(size_t numThreads)
+    : mNextSessionSeqNo(0) {
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+
+    for (size_t i = 0; i < numThreads; ++i) {
+        mShards.push(new Shard(this, i));
+    }
 
     // diabled send log output
     char val[PROPERTY_VALUE_MAX];
@@ -570,58 +3450,100 @@ ANetworkSession::ANetworkSession()
 }
 
 ANetworkSession::~ANetworkSession() {
+    if (mResolverThread != NULL) {
+        mResolverThread->stop();
+        mResolverThread.clear();
+    }
+
     stop();
 }
 
 status_t ANetworkSession::start() {
-    if (mThread != NULL) {
-        return INVALID_OPERATION;
+    for (size_t i = 0; i < mShards.size(); ++i) {
+        status_t err = mShards.itemAt(i)->start();
+
+        if (err != OK) {
+            while (i > 0) {
+                mShards.itemAt(--i)->stop();
+            }
+
+            return err;
+        }
     }
 
-    int res = pipe(mPipeFd);
-    if (res != 0) {
-        mPipeFd[0] = mPipeFd[1] = -1;
-        return -errno;
+    return OK;
+}
+
+status_t ANetworkSession::stop() {
+    status_t err = OK;
+
+    for (size_t i = 0; i < mShards.size(); ++i) {
+        status_t shardErr = mShards.itemAt(i)->stop();
+
+        if (err == OK) {
+            err = shardErr;
+        }
     }
 
-    mThread = new NetworkThread(this);
+    return err;
+}
+
+int32_t ANetworkSession::allocateSessionID(int32_t affinitySessionID) {
+    size_t numShards = mShards.size();
+    int32_t seqNo = android_atomic_inc(&mNextSessionSeqNo);
 
-    status_t err = mThread->run("ANetworkSession", ANDROID_PRIORITY_AUDIO);
+    size_t shardIndex =
+        (affinitySessionID > 0)
+            ? ShardIndexForSession(affinitySessionID, numShards)
+            : seqNo % numShards;
 
-    if (err != OK) {
-        mThread.clear();
+    return seqNo * numShards + shardIndex + 1;
+}
 
-        close(mPipeFd[0]);
-        close(mPipeFd[1]);
-        mPipeFd[0] = mPipeFd[1] = -1;
+// static
+size_t ANetworkSession::ShardIndexForSession(
+        int32_t sessionID, size_t numShards) {
+    return (sessionID - 1) % numShards;
+}
 
-        return err;
+status_t ANetworkSession::pushCommand(Command *cmd) {
+    if (cmd->mSessionID <= 0) {
+        delete cmd;
+        return -ENOENT;
     }
 
+    size_t shardIndex = ShardIndexForSession(cmd->mSessionID, mShards.size());
+    mShards.itemAt(shardIndex)->pushCommand(cmd);
+
     return OK;
 }
 
-status_t ANetworkSession::stop() {
-    if (mThread == NULL) {
-        return INVALID_OPERATION;
-    }
+// static
+sp<ANetworkSession::Poller> ANetworkSession::CreatePoller() {
+    char val[PROPERTY_VALUE_MAX];
+    bool useSelect =
+        property_get("persist.sys.wfd.poller", val, NULL)
+            && !strcmp("select", val);
 
-    mThread->requestExit();
-    interrupt();
-    mThread->requestExitAndWait();
+    if (!useSelect) {
+        sp<Poller> poller = new EPollPoller;
 
-    mThread.clear();
+        if (poller->initCheck() == OK) {
+            ALOGI("using epoll based network poller");
+            return poller;
+        }
+
+        ALOGW("epoll unavailable, falling back to select");
+    }
 
-    close(mPipeFd[0]);
-    close(mPipeFd[1]);
-    mPipeFd[0] = mPipeFd[1] = -1;
+    ALOGI("using select based network poller");
 
-    return OK;
+    return new SelectPoller;
 }
 
 status_t ANetworkSession::createRTSPClient(
         const char *host, unsigned port, const sp<AMessage> &notify,
-        int32_t *sessionID) {
+        int32_t *sessionID, const SessionOptions *options) {
     return createClientOrServer(
             kModeCreateRTSPClient,
             NULL /* addr */,
@@ -629,12 +3551,14 @@ status_t ANetworkSession::createRTSPClient(
             host,
             port,
             notify,
-            sessionID);
+            sessionID,
+            options);
 }
 
 status_t ANetworkSession::createRTSPServer(
         const struct in_addr &addr, unsigned port,
-        const sp<AMessage> &notify, int32_t *sessionID) {
+        const sp<AMessage> &notify, int32_t *sessionID,
+        const SessionOptions *options) {
     return createClientOrServer(
             kModeCreateRTSPServer,
             &addr,
@@ -642,12 +3566,15 @@ status_t ANetworkSession::createRTSPServer(
             NULL /* remoteHost */,
             0 /* remotePort */,
             notify,
-            sessionID);
+            sessionID,
+            options);
 }
 
 status_t ANetworkSession::createUDPSession(
-        unsigned localPort, const sp<AMessage> &notify, int32_t *sessionID) {
-    return createUDPSession(localPort, NULL, 0, notify, sessionID);
+        unsigned localPort, const sp<AMessage> &notify, int32_t *sessionID,
+        const SessionOptions *options) {
+    return createUDPSession(
+            localPort, NULL, 0, notify, sessionID, options);
 }
 
 status_t ANetworkSession::createUDPSession(
@@ -655,7 +3582,8 @@ status_t ANetworkSession::createUDPSession(
         const char *remoteHost,
         unsigned remotePort,
         const sp<AMessage> &notify,
-        int32_t *sessionID) {
+        int32_t *sessionID,
+        const SessionOptions *options) {
     return createClientOrServer(
             kModeCreateUDPSession,
             NULL /* addr */,
@@ -663,12 +3591,14 @@ status_t ANetworkSession::createUDPSession(
             remoteHost,
             remotePort,
             notify,
-            sessionID);
+            sessionID,
+            options);
 }
 
 status_t ANetworkSession::createTCPDatagramSession(
         const struct in_addr &addr, unsigned port,
-        const sp<AMessage> &notify, int32_t *sessionID) {
+        const sp<AMessage> &notify, int32_t *sessionID,
+        const SessionOptions *options) {
     return createClientOrServer(
             kModeCreateTCPDatagramSessionPassive,
             &addr,
@@ -676,7 +3606,8 @@ status_t ANetworkSession::createTCPDatagramSession(
             NULL /* remoteHost */,
             0 /* remotePort */,
             notify,
-            sessionID);
+            sessionID,
+            options);
 }
 
 status_t ANetworkSession::createTCPDatagramSession(
@@ -684,7 +3615,8 @@ status_t ANetworkSession::createTCPDatagramSession(
         const char *remoteHost,
         unsigned remotePort,
         const sp<AMessage> &notify,
-        int32_t *sessionID) {
+        int32_t *sessionID,
+        const SessionOptions *options) {
     return createClientOrServer(
             kModeCreateTCPDatagramSessionActive,
             NULL /* addr */,
@@ -692,7 +3624,8 @@ status_t ANetworkSession::createTCPDatagramSession(
             remoteHost,
             remotePort,
             notify,
-            sessionID);
+            sessionID,
+            options);
 }
 
 status_t ANetworkSession::destroySession(int32_t sessionID) {
@@ -706,9 +3639,9 @@ status_t ANetworkSession::destroySession(int32_t sessionID) {
 
     mSessions.removeItemsAt(index);
 
-    interrupt();
-
-    return OK;
+    // The network thread may be in the middle of I/O on the session, it
+    // drops its own reference when it gets to this command.
+    return pushCommand(new Command(Command::kTypeDestroySession, sessionID));
 }
 
 // static
@@ -726,6 +3659,94 @@ status_t ANetworkSession::MakeSocketNonBlocking(int s) {
     return OK;
 }
 
+// static
+status_t ANetworkSession::ApplySessionOptions(
+        int s, bool isDatagram, const SessionOptions &options) {
+    int receiveBufferSize = options.mReceiveBufferSize;
+    int sendBufferSize = options.mSendBufferSize;
+
+    if (isDatagram) {
+        if (receiveBufferSize < 0) {
+            receiveBufferSize = kDefaultUDPBufferSize;
+        }
+
+        if (sendBufferSize < 0) {
+            sendBufferSize = kDefaultUDPBufferSize;
+        }
+    }
+
+    if (receiveBufferSize >= 0
+            && setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+                          &receiveBufferSize, sizeof(receiveBufferSize)) < 0) {
+        return -errno;
+    }
+
+    if (sendBufferSize >= 0
+            && setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+                          &sendBufferSize, sizeof(sendBufferSize)) < 0) {
+        return -errno;
+    }
+
+    // The remaining options are hints, failing to apply them is not fatal.
+
+    if (options.mTypeOfService >= 0) {
+        int tos = options.mTypeOfService;
+        if (setsockopt(s, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+            ALOGW("Unable to set IP_TOS 0x%02x on socket %d (%s)",
+                  tos, s, strerror(errno));
+        }
+    }
+
+    if (options.mPriority >= 0) {
+        int priority = options.mPriority;
+        if (setsockopt(s, SOL_SOCKET, SO_PRIORITY,
+                       &priority, sizeof(priority)) < 0) {
+            ALOGW("Unable to set SO_PRIORITY %d on socket %d (%s)",
+                  priority, s, strerror(errno));
+        }
+    }
+
+    if (options.mBusyPollUs > 0) {
+#ifdef SO_BUSY_POLL
+        int busyPollUs = options.mBusyPollUs;
+        if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL,
+                       &busyPollUs, sizeof(busyPollUs)) < 0) {
+            ALOGW("Unable to set SO_BUSY_POLL %d on socket %d (%s)",
+                  busyPollUs, s, strerror(errno));
+        }
+#else
+        ALOGW("SO_BUSY_POLL is not supported");
+#endif
+    }
+
+    if (options.mNoDelay && !isDatagram) {
+        const int yes = 1;
+        if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+            ALOGW("Unable to set TCP_NODELAY on socket %d (%s)",
+                  s, strerror(errno));
+        }
+    }
+
+    if (options.mMTUDiscover >= 0) {
+        int mtuDiscover = options.mMTUDiscover;
+        if (setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER,
+                       &mtuDiscover, sizeof(mtuDiscover)) < 0) {
+            ALOGW("Unable to set IP_MTU_DISCOVER %d on socket %d (%s)",
+                  mtuDiscover, s, strerror(errno));
+        }
+    }
+
+    if (options.mReceiveTimestamps) {
+        const int yes = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) < 0) {
+            ALOGW("Unable to set SO_TIMESTAMPNS on socket %d (%s)",
+                  s, strerror(errno));
+        }
+    }
+
+    return OK;
+}
+
 status_t ANetworkSession::createClientOrServer(
         Mode mode,
         const struct in_addr *localAddr,
@@ -733,14 +3754,22 @@ status_t ANetworkSession::createClientOrServer(
         const char *remoteHost,
         unsigned remotePort,
         const sp<AMessage> &notify,
-        int32_t *sessionID) {
-    Mutex::Autolock autoLock(mLock);
-
+        int32_t *sessionID,
+        const SessionOptions *options) {
     *sessionID = 0;
     status_t err = OK;
     int s, res;
     sp<Session> session;
 
+    SessionOptions defaultOptions;
+    if (options == NULL) {
+        options = &defaultOptions;
+    }
+
+    // Set if "remoteHost" is not a numeric address, in which case the socket
+    // is connected once the resolver thread is done with it.
+    bool resolving = false;
+
     s = socket(
             AF_INET,
             (mode == kModeCreateUDPSession) ? SOCK_DGRAM : SOCK_STREAM,
@@ -762,22 +3791,10 @@ status_t ANetworkSession::createClientOrServer(
         }
     }
 
-    if (mode == kModeCreateUDPSession) {
-        int size = 256 * 1024;
-
-        res = setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
-
-        if (res < 0) {
-            err = -errno;
-            goto bail2;
-        }
-
-        res = setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    err = ApplySessionOptions(s, mode == kModeCreateUDPSession, *options);
 
-        if (res < 0) {
-            err = -errno;
-            goto bail2;
-        }
+    if (err != OK) {
+        goto bail2;
     }
 
     err = MakeSocketNonBlocking(s);
@@ -792,13 +3809,7 @@ status_t ANetworkSession::createClientOrServer(
 
     if (mode == kModeCreateRTSPClient
             || mode == kModeCreateTCPDatagramSessionActive) {
-        struct hostent *ent= gethostbyname(remoteHost);
-        if (ent == NULL) {
-            err = -h_errno;
-            goto bail2;
-        }
-
-        addr.sin_addr.s_addr = *(in_addr_t *)ent->h_addr;
+        resolving = !inet_aton(remoteHost, &addr.sin_addr);
         addr.sin_port = htons(remotePort);
     } else if (localAddr != NULL) {
         addr.sin_addr = *localAddr;
@@ -808,7 +3819,10 @@ status_t ANetworkSession::createClientOrServer(
         addr.sin_port = htons(port);
     }
 
-    if (mode == kModeCreateRTSPClient
+    if (resolving) {
+        ALOGI("socket %d waits for '%s' to be resolved", s, remoteHost);
+        res = 0;
+    } else if (mode == kModeCreateRTSPClient
             || mode == kModeCreateTCPDatagramSessionActive) {
         in_addr_t x = ntohl(addr.sin_addr.s_addr);
         ALOGI("connecting socket %d to %d.%d.%d.%d:%d",
@@ -841,18 +3855,14 @@ status_t ANetworkSession::createClientOrServer(
                     remoteAddr.sin_family = AF_INET;
                     remoteAddr.sin_port = htons(remotePort);
 
-                    struct hostent *ent= gethostbyname(remoteHost);
-                    if (ent == NULL) {
-                        err = -h_errno;
-                        goto bail2;
+                    if (inet_aton(remoteHost, &remoteAddr.sin_addr)) {
+                        res = connect(
+                                s,
+                                (const struct sockaddr *)&remoteAddr,
+                                sizeof(remoteAddr));
+                    } else {
+                        resolving = true;
                     }
-
-                    remoteAddr.sin_addr.s_addr = *(in_addr_t *)ent->h_addr;
-
-                    res = connect(
-                            s,
-                            (const struct sockaddr *)&remoteAddr,
-                            sizeof(remoteAddr));
                 }
             }
         }
@@ -888,20 +3898,40 @@ status_t ANetworkSession::createClientOrServer(
     }
 
     session = new Session(
-            mNextSessionID++,
+            allocateSessionID(options->mAffinitySessionID),
             state,
             s,
             notify);
 
+    session->setOptions(*options);
+
     if (mode == kModeCreateTCPDatagramSessionActive) {
         session->setIsRTSPConnection(false);
     } else if (mode == kModeCreateRTSPClient) {
         session->setIsRTSPConnection(true);
     }
 
-    mSessions.add(session->sessionID(), session);
+    session->setResolving(resolving);
 
-    interrupt();
+    {
+        Mutex::Autolock autoLock(mLock);
+        mSessions.add(session->sessionID(), session);
+    }
+
+    {
+        Command *cmd = new Command(
+                Command::kTypeAddSession, session->sessionID());
+
+        cmd->mSession = session;
+
+        err = pushCommand(cmd);
+    }
+
+    if (resolving) {
+        // Queued after the session's registration, the connect completes
+        // on its network thread.
+        resolveAndConnect(session->sessionID(), remoteHost, remotePort);
+    }
 
     *sessionID = session->sessionID();
 
@@ -917,236 +3947,203 @@ bail:
 
 status_t ANetworkSession::connectUDPSession(
         int32_t sessionID, const char *remoteHost, unsigned remotePort) {
-    Mutex::Autolock autoLock(mLock);
+    sp<Session> session;
 
-    ssize_t index = mSessions.indexOfKey(sessionID);
+    {
+        Mutex::Autolock autoLock(mLock);
 
-    if (index < 0) {
-        return -ENOENT;
-    }
+        ssize_t index = mSessions.indexOfKey(sessionID);
 
-    const sp<Session> session = mSessions.valueAt(index);
-    int s = session->socket();
+        if (index < 0) {
+            return -ENOENT;
+        }
+
+        session = mSessions.valueAt(index);
+    }
 
     struct sockaddr_in remoteAddr;
     memset(remoteAddr.sin_zero, 0, sizeof(remoteAddr.sin_zero));
     remoteAddr.sin_family = AF_INET;
     remoteAddr.sin_port = htons(remotePort);
 
-    status_t err = OK;
-    struct hostent *ent = gethostbyname(remoteHost);
-    if (ent == NULL) {
-        err = -h_errno;
-    } else {
-        remoteAddr.sin_addr.s_addr = *(in_addr_t *)ent->h_addr;
-
-        int res = connect(
-                s,
-                (const struct sockaddr *)&remoteAddr,
-                sizeof(remoteAddr));
-
-        if (res < 0) {
-            err = -errno;
-        }
+    if (!inet_aton(remoteHost, &remoteAddr.sin_addr)) {
+        resolveAndConnect(sessionID, remoteHost, remotePort);
+        return OK;
     }
 
-    return err;
+    int res = connect(
+            session->socket(),
+            (const struct sockaddr *)&remoteAddr,
+            sizeof(remoteAddr));
+
+    return res < 0 ? -errno : OK;
 }
 
-status_t ANetworkSession::sendRequest(
-        int32_t sessionID, const void *data, ssize_t size) {
+void ANetworkSession::setResolver(const sp<Resolver> &resolver) {
     Mutex::Autolock autoLock(mLock);
+    mResolver = resolver;
+}
 
-    ssize_t index = mSessions.indexOfKey(sessionID);
+void ANetworkSession::resolveAndConnect(
+        int32_t sessionID, const char *host, unsigned port) {
+    Mutex::Autolock autoLock(mLock);
 
-    if (index < 0) {
-        return -ENOENT;
+    if (mResolverThread == NULL) {
+        mResolverThread = new ResolverThread(this);
+        mResolverThread->run("ANetworkSession/resolver");
     }
 
-    const sp<Session> session = mSessions.valueAt(index);
-
-    status_t err = session->sendRequest(data, size);
-
-    interrupt();
-
-    if (!mDiabledLog) {
-        ALOGD("--> --> --> sendRequest() session[%d] result[%d]", sessionID, err);
-        ALOGD("[%s]", (char*)data);
+    if (mResolver == NULL) {
+        mResolver = new AddrInfoResolver;
     }
 
-    return err;
+    mResolverThread->queueRequest(sessionID, host, port, mResolver);
 }
 
-void ANetworkSession::interrupt() {
-    static const char dummy = 0;
-
-    ssize_t n;
-    do {
-        n = write(mPipeFd[1], &dummy, 1);
-    } while (n < 0 && errno == EINTR);
-
-    if (n < 0) {
-        ALOGW("Error writing to pipe (%s)", strerror(errno));
-    }
+status_t ANetworkSession::sendRequest(
+        int32_t sessionID, const sp<ABuffer> &buffer, Priority priority) {
+    return sendRequest(sessionID, &buffer, 1, priority);
 }
 
-void ANetworkSession::threadLoop() {
-    fd_set rs, ws;
-    FD_ZERO(&rs);
-    FD_ZERO(&ws);
-
-    FD_SET(mPipeFd[0], &rs);
-    int maxFd = mPipeFd[0];
-
-    {
-        Mutex::Autolock autoLock(mLock);
+status_t ANetworkSession::sendRequest(
+        int32_t sessionID, const sp<ABuffer> *buffers, size_t count,
+        Priority priority) {
+    Command *cmd = new Command(Command::kTypeSendRequest, sessionID);
+    cmd->mQueuedUs = ALooper::GetNowUs();
+    cmd->mPriority = priority;
+
+    if (count <= Command::kMaxBuffers) {
+        for (size_t i = 0; i < count; ++i) {
+            cmd->mBuffers[i] = buffers[i];
+        }
 
-        for (size_t i = 0; i < mSessions.size(); ++i) {
-            const sp<Session> &session = mSessions.valueAt(i);
+        cmd->mNumBuffers = count;
+    } else {
+        // Rare enough that a copy beats making every command variable size.
+        size_t size = 0;
+        for (size_t i = 0; i < count; ++i) {
+            size += buffers[i]->size();
+        }
 
-            int s = session->socket();
+        sp<ABuffer> buffer = new ABuffer(size);
 
-            if (s < 0) {
-                continue;
-            }
+        size_t offset = 0;
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(buffer->data() + offset,
+                   buffers[i]->data(),
+                   buffers[i]->size());
 
-            if (session->wantsToRead()) {
-                FD_SET(s, &rs);
-                if (s > maxFd) {
-                    maxFd = s;
-                }
-            }
+            offset += buffers[i]->size();
 
-            if (session->wantsToWrite()) {
-                FD_SET(s, &ws);
-                if (s > maxFd) {
-                    maxFd = s;
-                }
+            // The frame time is all the session looks at, see
+            // Session::sendRequest().
+            int64_t timeUs;
+            if (buffers[i]->meta()->findInt64("timeUs", &timeUs)) {
+                buffer->meta()->setInt64("timeUs", timeUs);
             }
         }
+
+        cmd->mBuffers[0] = buffer;
+        cmd->mNumBuffers = 1;
     }
 
-    int res = select(maxFd + 1, &rs, &ws, NULL, NULL /* tv */);
+    status_t err = pushCommand(cmd);
 
-    if (res == 0) {
-        return;
-    }
+    ALOGV("sendRequest() session[%d] result[%d] buffers[%d]",
+          sessionID, err, count);
 
-    if (res < 0) {
-        if (errno == EINTR) {
-            return;
-        }
+    return err;
+}
 
-        ALOGE("select failed w/ error %d (%s)", errno, strerror(errno));
-        return;
+status_t ANetworkSession::sendInterleavedData(
+        int32_t sessionID, unsigned channel, const sp<ABuffer> &data) {
+    if (channel > 0xff || data->size() > 0xffff) {
+        return -EINVAL;
     }
 
-    if (FD_ISSET(mPipeFd[0], &rs)) {
-        char c;
-        ssize_t n;
-        do {
-            n = read(mPipeFd[0], &c, 1);
-        } while (n < 0 && errno == EINTR);
+    Command *cmd = new Command(Command::kTypeSendInterleavedData, sessionID);
 
-        if (n < 0) {
-            ALOGW("Error reading from pipe (%s)", strerror(errno));
-        }
+    sp<ABuffer> header = new ABuffer(4);
+    header->data()[0] = '$';
+    header->data()[1] = channel;
+    header->data()[2] = data->size() >> 8;
+    header->data()[3] = data->size() & 0xff;
+
+    cmd->mBuffers[0] = header;
+    cmd->mBuffers[1] = data;
+    cmd->mNumBuffers = 2;
+    cmd->mQueuedUs = ALooper::GetNowUs();
+
+    return pushCommand(cmd);
+}
 
-        --res;
+status_t ANetworkSession::setDatagramBatchSize(
+        int32_t sessionID, size_t maxPackets) {
+    Command *cmd = new Command(Command::kTypeSetDatagramBatchSize, sessionID);
+    cmd->mDatagramBatchSize = maxPackets;
+
+    return pushCommand(cmd);
+}
+
+status_t ANetworkSession::setPacing(
+        int32_t sessionID, int32_t bitsPerSecond, size_t burstBytes) {
+    if (bitsPerSecond < 0) {
+        return -EINVAL;
     }
 
-    {
-        Mutex::Autolock autoLock(mLock);
+    Command *cmd = new Command(Command::kTypeSetPacing, sessionID);
+    cmd->mPacingRate = bitsPerSecond;
+    cmd->mPacingBurstBytes = burstBytes;
 
-        List<sp<Session> > sessionsToAdd;
+    return pushCommand(cmd);
+}
 
-        for (size_t i = mSessions.size(); res > 0 && i-- > 0;) {
-            const sp<Session> &session = mSessions.valueAt(i);
+status_t ANetworkSession::setMediaLatencyBudget(
+        int32_t sessionID, int64_t budgetUs) {
+    if (budgetUs < 0ll) {
+        return -EINVAL;
+    }
 
-            int s = session->socket();
+    Command *cmd = new Command(Command::kTypeSetMediaLatencyBudget, sessionID);
+    cmd->mLatencyBudgetUs = budgetUs;
 
-            if (s < 0) {
-                continue;
-            }
+    return pushCommand(cmd);
+}
 
-            if (FD_ISSET(s, &rs) || FD_ISSET(s, &ws)) {
-                --res;
-            }
+status_t ANetworkSession::requestSessionStats(
+        int32_t sessionID, const sp<AMessage> &reply) {
+    Command *cmd = new Command(Command::kTypeGetStats, sessionID);
+    cmd->mReply = reply;
 
-            if (FD_ISSET(s, &rs)) {
-                if (session->isRTSPServer() || session->isTCPDatagramServer()) {
-                    struct sockaddr_in remoteAddr;
-                    socklen_t remoteAddrLen = sizeof(remoteAddr);
-
-                    int clientSocket = accept(
-                            s, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
-
-                    if (clientSocket >= 0) {
-                        status_t err = MakeSocketNonBlocking(clientSocket);
-
-                        if (err != OK) {
-                            ALOGE("Unable to make client socket non blocking, "
-                                  "failed w/ error %d (%s)",
-                                  err, strerror(-err));
-
-                            close(clientSocket);
-                            clientSocket = -1;
-                        } else {
-                            in_addr_t addr = ntohl(remoteAddr.sin_addr.s_addr);
-
-                            ALOGI("incoming connection from %d.%d.%d.%d:%d "
-                                  "(socket %d)",
-                                  (addr >> 24),
-                                  (addr >> 16) & 0xff,
-                                  (addr >> 8) & 0xff,
-                                  addr & 0xff,
-                                  ntohs(remoteAddr.sin_port),
-                                  clientSocket);
-
-                            sp<Session> clientSession =
-                                // using socket sd as sessionID
-                                new Session(
-                                        mNextSessionID++,
-                                        Session::CONNECTED,
-                                        clientSocket,
-                                        session->getNotificationMessage());
-
-                            clientSession->setIsRTSPConnection(
-                                    session->isRTSPServer());
-
-                            sessionsToAdd.push_back(clientSession);
-                        }
-                    } else {
-                        ALOGE("accept returned error %d (%s)",
-                              errno, strerror(errno));
-                    }
-                } else {
-                    status_t err = session->readMore();
-                    if (err != OK) {
-                        ALOGE("readMore on socket %d failed w/ error %d (%s)",
-                              s, err, strerror(-err));
-                    }
-                }
-            }
+    return pushCommand(cmd);
+}
 
-            if (FD_ISSET(s, &ws)) {
-                status_t err = session->writeMore();
-                if (err != OK) {
-                    ALOGE("writeMore on socket %d failed w/ error %d (%s)",
-                          s, err, strerror(-err));
-                }
-            }
-        }
+status_t ANetworkSession::sendRequest(
+        int32_t sessionID, const void *data, ssize_t size) {
+    if (size < 0) {
+        size = strlen((const char *)data);
+    }
 
-        while (!sessionsToAdd.empty()) {
-            sp<Session> session = *sessionsToAdd.begin();
-            sessionsToAdd.erase(sessionsToAdd.begin());
+    // The caller's data has to be copied before returning, which happens
+    // here rather than on the network thread.
+    sp<ABuffer> buffer = new ABuffer(size);
+    memcpy(buffer->data(), data, size);
 
-            mSessions.add(session->sessionID(), session);
+    Command *cmd = new Command(Command::kTypeSendRequest, sessionID);
+    cmd->mBuffers[0] = buffer;
+    cmd->mNumBuffers = 1;
+    cmd->mQueuedUs = ALooper::GetNowUs();
+    cmd->mPriorityBySession = true;
 
-            ALOGI("added clientSession %d", session->sessionID());
-        }
+    status_t err = pushCommand(cmd);
+
+    if (!mDiabledLog) {
+        ALOGD("--> --> --> sendRequest() session[%d] result[%d]",
+              sessionID, err);
+        ALOGD("[%s]", (char*)data);
     }
+
+    return err;
 }
 
 }  // namespace android
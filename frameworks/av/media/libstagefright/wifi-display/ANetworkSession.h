@@ -22,46 +22,168 @@
 #include <utils/KeyedVector.h>
 #include <utils/RefBase.h>
 #include <utils/Thread.h>
+#include <utils/Vector.h>
 
 #include <netinet/in.h>
 
 namespace android {
 
+struct ABuffer;
 struct AMessage;
 
 // Helper class to manage a number of live sockets (datagram and stream-based)
-// on a single thread. Clients are notified about activity through AMessages.
+// on one or more network threads. Clients are notified about activity through
+// AMessages.
 struct ANetworkSession : public RefBase {
-    ANetworkSession();
+    // Gets to modify each datagram of a UDP session right before it is
+    // written, on the session's network thread. Runs exactly once per
+    // datagram, even if writing it has to be retried. Buffers queued by
+    // reference are modified in place.
+    struct EgressHook : public RefBase {
+        EgressHook() {}
+
+        virtual void onEgress(
+                int32_t sessionID, const sp<ABuffer> &datagram) = 0;
+
+    protected:
+        virtual ~EgressHook() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(EgressHook);
+    };
+
+    // Overwrites the timestamp of RTP packets carrying MPEG-2 TS (payload
+    // type 33) with the time they are sent, on a 90kHz time scale. Used to
+    // be applied to all UDP sessions, now it has to be asked for.
+    struct RTPTimeRewriter : public EgressHook {
+        RTPTimeRewriter() {}
+
+        virtual void onEgress(int32_t sessionID, const sp<ABuffer> &datagram);
+
+    protected:
+        virtual ~RTPTimeRewriter() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(RTPTimeRewriter);
+    };
+
+    // Optional per-session tuning, accepted by every create* method. Fields
+    // left at their defaults leave the corresponding socket option alone.
+    // Sessions accepted by a server inherit the server's options.
+    struct SessionOptions {
+        enum {
+            // IP_TOS values mapped to the WMM video and voice access
+            // categories by the Wi-Fi driver.
+            kTOSVideo = 0xa0,
+            kTOSVoice = 0xc0,
+        };
+
+        SessionOptions();
+
+        // SO_RCVBUF/SO_SNDBUF in bytes, -1 keeps the default for the type of
+        // session, 256 KB for UDP sessions and the system's otherwise.
+        int32_t mReceiveBufferSize;
+        int32_t mSendBufferSize;
+
+        // IP_TOS, -1 to leave unset.
+        int32_t mTypeOfService;
+
+        // SO_PRIORITY, -1 to leave unset.
+        int32_t mPriority;
+
+        // SO_BUSY_POLL in microseconds, 0 to leave disabled.
+        int32_t mBusyPollUs;
+
+        // TCP_NODELAY, ignored for UDP sessions.
+        bool mNoDelay;
+
+        // IP_MTU_DISCOVER, one of IP_PMTUDISC_*, -1 to leave unset.
+        int32_t mMTUDiscover;
+
+        // SO_TIMESTAMPNS, the "arrivalTimeUs" of received datagrams is then
+        // derived from the time the kernel received them rather than the
+        // time they were read. The difference is stored as "receiveDelayUs".
+        bool mReceiveTimestamps;
+
+        // If non-zero the session is serviced by the same network thread as
+        // this session, e.g. to keep the RTP and RTCP sessions of a stream
+        // together. Sessions are spread over the threads round-robin
+        // otherwise.
+        int32_t mAffinitySessionID;
+
+        // Applied to every outgoing datagram of a UDP session, NULL for none.
+        sp<EgressHook> mEgressHook;
+
+        // If positive, queued media requests are dropped rather than sent
+        // once more than this many microseconds have passed since the
+        // "timeUs" of their frame, found in the meta data of their buffers
+        // and taken to be in the ALooper::GetNowUs() time base. Requests of
+        // the same frame share its "timeUs" and are dropped together. Only
+        // requests queued through the sp<ABuffer> overloads of sendRequest()
+        // can carry a "timeUs", raw data never has a deadline.
+        int64_t mMediaDeadlineUs;
+
+        // Post kWhatMediaDropped whenever queued media is dropped, e.g. to
+        // ask the encoder for an IDR frame.
+        bool mNotifyMediaDropped;
+    };
+
+    // "numThreads" network threads are run, each with its own poller and
+    // share of the sessions.
+    ANetworkSession(size_t numThreads = 1);
 
     status_t start();
     status_t stop();
 
     status_t createRTSPClient(
             const char *host, unsigned port, const sp<AMessage> &notify,
-            int32_t *sessionID);
+            int32_t *sessionID, const SessionOptions *options = NULL);
 
     status_t createRTSPServer(
             const struct in_addr &addr, unsigned port,
-            const sp<AMessage> &notify, int32_t *sessionID);
+            const sp<AMessage> &notify, int32_t *sessionID,
+            const SessionOptions *options = NULL);
 
     status_t createUDPSession(
-            unsigned localPort, const sp<AMessage> &notify, int32_t *sessionID);
+            unsigned localPort, const sp<AMessage> &notify, int32_t *sessionID,
+            const SessionOptions *options = NULL);
 
     status_t createUDPSession(
             unsigned localPort,
             const char *remoteHost,
             unsigned remotePort,
             const sp<AMessage> &notify,
-            int32_t *sessionID);
+            int32_t *sessionID,
+            const SessionOptions *options = NULL);
 
     status_t connectUDPSession(
             int32_t sessionID, const char *remoteHost, unsigned remotePort);
 
+    // A "remoteHost" given to the methods above that is not a numeric IPv4
+    // address is resolved on a worker thread, the socket is then connected
+    // asynchronously. Once it is, the session posts kWhatConnected (also
+    // for UDP sessions in this case), or kWhatError if resolution failed.
+    struct Resolver : public RefBase {
+        Resolver() {}
+
+        virtual status_t resolve(const char *host, struct in_addr *addr) = 0;
+
+    protected:
+        virtual ~Resolver() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(Resolver);
+    };
+
+    // Replaces the default, getaddrinfo() based resolver, e.g. by a stand-in
+    // for testing. Only affects requests made after this call.
+    void setResolver(const sp<Resolver> &resolver);
+
     // passive
     status_t createTCPDatagramSession(
             const struct in_addr &addr, unsigned port,
-            const sp<AMessage> &notify, int32_t *sessionID);
+            const sp<AMessage> &notify, int32_t *sessionID,
+            const SessionOptions *options = NULL);
 
     // active
     status_t createTCPDatagramSession(
@@ -69,13 +191,101 @@ struct ANetworkSession : public RefBase {
             const char *remoteHost,
             unsigned remotePort,
             const sp<AMessage> &notify,
-            int32_t *sessionID);
+            int32_t *sessionID,
+            const SessionOptions *options = NULL);
 
     status_t destroySession(int32_t sessionID);
 
+    // Every session queues outgoing requests in two lanes. Queued control
+    // requests are written ahead of queued media, but never in the middle
+    // of a request that has already been partially written to a stream,
+    // e.g. an interleaved frame.
+    enum Priority {
+        kPriorityControl,
+        kPriorityMedia,
+    };
+
+    // The send methods and setDatagramBatchSize() don't block on the network
+    // thread, they queue a command for it and return immediately. Commands
+    // for sessions that no longer exist are dropped.
+    // The raw data overload queues its request with kPriorityControl on RTSP
+    // connections and with kPriorityMedia on all other sessions.
     status_t sendRequest(
             int32_t sessionID, const void *data, ssize_t size = -1);
 
+    // Queue "buffer" by reference instead of copying its contents. The
+    // buffer must not be modified by the caller after this call, outgoing
+    // datagrams may be modified in place by the session's EgressHook.
+    status_t sendRequest(
+            int32_t sessionID, const sp<ABuffer> &buffer,
+            Priority priority = kPriorityMedia);
+
+    // Queue "count" buffers that are sent back to back as one request, e.g.
+    // a header followed by its payload. Stream sessions queue them by
+    // reference, datagram sessions coalesce them into a single datagram.
+    status_t sendRequest(
+            int32_t sessionID, const sp<ABuffer> *buffers, size_t count,
+            Priority priority = kPriorityMedia);
+
+    // Queue "data" as an RTSP interleaved frame on the given channel, with
+    // kPriorityMedia. The '$' header and the payload (by reference) are
+    // queued as a single command and are guaranteed to be contiguous in the
+    // stream.
+    status_t sendInterleavedData(
+            int32_t sessionID, unsigned channel, const sp<ABuffer> &data);
+
+    // Media requests that have been queued for longer than "budgetUs" are
+    // dropped whole, along with the rest of their frame if their buffers'
+    // meta data has a "timeUs", instead of being sent late. A budget of 0,
+    // the default, never drops anything.
+    status_t setMediaLatencyBudget(int32_t sessionID, int64_t budgetUs);
+
+    // Instead of posting one kWhatDatagram notification per packet, pull up
+    // to "maxPackets" datagrams per syscall from the UDP session and deliver
+    // them as a single kWhatDatagramBatch notification. A "maxPackets" value
+    // of 0 or 1 restores per-packet notifications. Packets are always
+    // notified one at a time where the platform lacks recvmmsg().
+    status_t setDatagramBatchSize(int32_t sessionID, size_t maxPackets);
+
+    // Spread the datagrams written by a UDP session out to an average of
+    // "bitsPerSecond", letting through bursts of up to "burstBytes" (which
+    // defaults to a single datagram if 0). Keeps e.g. the packets of a large
+    // IDR frame from overflowing the queues of the access point. A rate of
+    // 0 disables pacing again. The burst is raised to at least what the rate
+    // accrues in a millisecond, the resolution datagrams are released at.
+    status_t setPacing(
+            int32_t sessionID, int32_t bitsPerSecond, size_t burstBytes);
+
+    // Posts "reply" with a snapshot of the session's counters, taken on its
+    // network thread. "err" is set to -ENOENT if there is no such session.
+    // The counters, all int64, cover the lifetime of the session:
+    //   "packetsIn", "bytesIn", "packetsOut", "bytesOut"
+    //   "eagain"               writes that found the socket buffer full
+    //   "receiveErrors", "sendErrors"
+    //   "queued", "queueHighWaterMark"
+    //                          buffers waiting to be written
+    //   "mediaDropped", "mediaBytesDropped", "framesDropped"
+    //                          media over the latency budget or deadline
+    //   "sendAllocations"      buffers allocated by the network thread to
+    //                          frame or coalesce requests
+    //   "queueDwellP50Us", "queueDwellP99Us", "queueDwellP999Us",
+    //   "queueDwellMaxUs"      time from a send call to the socket
+    //   "dispatchP50Us", "dispatchP99Us", "dispatchP999Us", "dispatchMaxUs"
+    //                          time from the poller reporting the socket
+    //                          ready to the session being serviced
+    //   "poolHits", "poolMisses", "poolHighWaterMark"
+    //                          receive buffer pool, if the session has one
+    //   "pacingRate", "pacingStalls", "pacingDelayP50Us",
+    //   "pacingDelayP99Us", "pacingDelayMaxUs"
+    //                          how long the pacer held datagrams back, if
+    //                          pacing is enabled
+    // Setting "persist.sys.wfd.statsinterval" to a number of seconds logs
+    // the same counters for every session at that interval, along with the
+    // packets handled and CPU time used by each network thread. Setting
+    // "persist.sys.wfd.statsformat" to "json" logs one JSON object per line
+    // instead, for collection by tools.
+    status_t requestSessionStats(int32_t sessionID, const sp<AMessage> &reply);
+
     enum NotificationReason {
         kWhatError,
         kWhatConnected,
@@ -83,6 +293,27 @@ struct ANetworkSession : public RefBase {
         kWhatData,
         kWhatDatagram,
         kWhatBinaryData,
+        kWhatDatagramBatch,
+
+        // Only posted if SessionOptions::mNotifyMediaDropped is set. Holds
+        // the number of "frames" and "requests" as well as the "bytes"
+        // dropped, "timeUs" is that of the most recent frame if known.
+        kWhatMediaDropped,
+    };
+
+    // Stored as "packets" in kWhatDatagramBatch notifications. The sender of
+    // each packet is found in its meta data as "fromIP" (host byte order)
+    // and "fromPort", instead of the "fromAddr" string of kWhatDatagram.
+    struct DatagramBatch : public RefBase {
+        DatagramBatch() {}
+
+        Vector<sp<ABuffer> > mPackets;
+
+    protected:
+        virtual ~DatagramBatch() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(DatagramBatch);
     };
 
 protected:
@@ -91,16 +322,36 @@ protected:
 private:
     struct NetworkThread;
     struct Session;
+    struct BufferPool;
+    struct BufferSlice;
+    struct MultiMessage;
+    struct LatencyHistogram;
+    union ReceiveControlBuffer;
+    struct Poller;
+    struct SelectPoller;
+    struct EPollPoller;
+    struct Command;
+    struct CommandQueue;
+    struct Shard;
+    struct AddrInfoResolver;
+    struct ResolverThread;
 
+    // Only guards mSessions and the resolver, never held across socket I/O
+    // or host name resolution.
     Mutex mLock;
-    sp<Thread> mThread;
 
-    int32_t mNextSessionID;
+    // Fixed at construction, session IDs encode the index of their shard.
+    Vector<sp<Shard> > mShards;
 
-    int mPipeFd[2];
+    volatile int32_t mNextSessionSeqNo;
 
+    // Sessions that can be looked up by clients.
     KeyedVector<int32_t, sp<Session> > mSessions;
 
+    // Created on first use.
+    sp<Resolver> mResolver;
+    sp<ResolverThread> mResolverThread;
+
     enum Mode {
         kModeCreateUDPSession,
         kModeCreateTCPDatagramSessionPassive,
@@ -115,10 +366,21 @@ private:
             const char *remoteHost,
             unsigned remotePort,
             const sp<AMessage> &notify,
-            int32_t *sessionID);
+            int32_t *sessionID,
+            const SessionOptions *options);
+
+    void resolveAndConnect(int32_t sessionID, const char *host, unsigned port);
+
+    int32_t allocateSessionID(int32_t affinitySessionID);
+
+    static status_t ApplySessionOptions(
+            int s, bool isDatagram, const SessionOptions &options);
+    static size_t ShardIndexForSession(int32_t sessionID, size_t numShards);
+
+    // Hands "cmd" to the shard servicing its session.
+    status_t pushCommand(Command *cmd);
 
-    void threadLoop();
-    void interrupt();
+    static sp<Poller> CreatePoller();
 
     static status_t MakeSocketNonBlocking(int s);
 
@@ -0,0 +1,1676 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "netbench"
+#include <utils/Log.h>
+
+#include "ANetworkSession.h"
+#include "sink/JitterBuffer.h"
+
+#include <arpa/inet.h>
+#include <linux/udp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/foundation/AString.h>
+#include <media/stagefright/Utils.h>
+
+#include <cutils/atomic.h>
+#include <utils/threads.h>
+
+namespace android {
+
+// Every benchmark packet starts with the time it was handed to the session
+// and its sequence number.
+static const size_t kPacketHeaderSize = 12;
+
+// How long to wait for packets still in flight once everything was sent.
+static const int64_t kDrainTimeoutUs = 1000000ll;
+
+// CPU time used by the process, or by the calling thread only if "who" is
+// RUSAGE_THREAD.
+static int64_t GetCPUTimeUs(int who = RUSAGE_SELF) {
+    struct rusage usage;
+    getrusage(who, &usage);
+
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ll
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int CompareInt64(const int64_t *a, const int64_t *b) {
+    return (*a < *b) ? -1 : (*a > *b) ? 1 : 0;
+}
+
+// "percent" of the sorted "values" are at most the value returned.
+static int64_t Percentile(const Vector<int64_t> &values, double percent) {
+    if (values.isEmpty()) {
+        return 0ll;
+    }
+
+    size_t index = (size_t)(values.size() * percent / 100.0);
+    if (index >= values.size()) {
+        index = values.size() - 1;
+    }
+
+    return values.itemAt(index);
+}
+
+static void WriteInt64(uint8_t *data, int64_t x) {
+    for (size_t i = 0; i < 8; ++i) {
+        data[i] = (x >> (56 - 8 * i)) & 0xff;
+    }
+}
+
+static int64_t ReadInt64(const uint8_t *data) {
+    int64_t x = 0ll;
+    for (size_t i = 0; i < 8; ++i) {
+        x = (x << 8) | data[i];
+    }
+
+    return x;
+}
+
+struct BenchParams {
+    BenchParams()
+        : mPacketSize(1316),
+          mBitsPerSecond(20000000ll),
+          mDurationUs(5000000ll),
+          mPort(19000),
+          mNumThreads(1),
+          mBatchSize(0),
+          mLossPercent(1.0),
+          mReorderPercent(5.0) {
+    }
+
+    size_t mPacketSize;
+    int64_t mBitsPerSecond;
+    int64_t mDurationUs;
+    unsigned mPort;
+    size_t mNumThreads;
+    size_t mBatchSize;
+    double mLossPercent;
+    double mReorderPercent;
+};
+
+// Sends packets over a pair of sessions connected through 127.0.0.1 and
+// keeps track of their delivery.
+struct SessionBench : public AHandler {
+    enum Transport {
+        kTransportUDP,
+        kTransportTCPDatagram,
+        kTransportRTSPInterleaved,
+    };
+
+    SessionBench(const sp<ANetworkSession> &netSession, Transport transport);
+
+    status_t setUp(const BenchParams &params);
+    void run(const BenchParams &params);
+    void tearDown();
+
+    static const char *TransportName(Transport transport);
+
+protected:
+    virtual ~SessionBench();
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatSenderNotify,
+        kWhatReceiverNotify,
+        kWhatSenderStats,
+        kWhatReceiverStats,
+    };
+
+    sp<ANetworkSession> mNetSession;
+    Transport mTransport;
+
+    Mutex mLock;
+    Condition mCondition;
+
+    int32_t mServerSessionID;
+    int32_t mSenderSessionID;
+    int32_t mReceiverSessionID;
+    bool mSenderConnected;
+    status_t mError;
+
+    int64_t mNumPacketsReceived;
+    int64_t mNumBytesReceived;
+    Vector<int64_t> mLatenciesUs;
+
+    sp<AMessage> mSenderStats;
+    sp<AMessage> mReceiverStats;
+
+    void onPacket(const sp<ABuffer> &packet);
+    status_t sendPacket(const sp<ABuffer> &packet);
+
+    // Waits until "condition" holds, "timeoutUs" at most.
+    bool waitFor(bool (SessionBench::*condition)() const, int64_t timeoutUs);
+
+    bool isConnected() const;
+    bool haveStats() const;
+
+    void printResults(
+            const BenchParams &params,
+            int64_t numPacketsSent, int64_t elapsedUs, int64_t cpuUs);
+
+    DISALLOW_EVIL_CONSTRUCTORS(SessionBench);
+};
+
+SessionBench::SessionBench(
+        const sp<ANetworkSession> &netSession, Transport transport)
+    : mNetSession(netSession),
+      mTransport(transport),
+      mServerSessionID(0),
+      mSenderSessionID(0),
+      mReceiverSessionID(0),
+      mSenderConnected(false),
+      mError(OK),
+      mNumPacketsReceived(0ll),
+      mNumBytesReceived(0ll) {
+}
+
+SessionBench::~SessionBench() {
+}
+
+// static
+const char *SessionBench::TransportName(Transport transport) {
+    switch (transport) {
+        case kTransportUDP:
+            return "udp";
+        case kTransportTCPDatagram:
+            return "tcp";
+        case kTransportRTSPInterleaved:
+            return "rtsp";
+        default:
+            TRESPASS();
+    }
+
+    return NULL;
+}
+
+status_t SessionBench::setUp(const BenchParams &params) {
+    sp<AMessage> senderNotify = new AMessage(kWhatSenderNotify, id());
+    sp<AMessage> receiverNotify = new AMessage(kWhatReceiverNotify, id());
+
+    struct in_addr addr;
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    status_t err;
+    switch (mTransport) {
+        case kTransportUDP:
+        {
+            err = mNetSession->createUDPSession(
+                    params.mPort, receiverNotify, &mReceiverSessionID);
+
+            if (err == OK && params.mBatchSize > 1) {
+                err = mNetSession->setDatagramBatchSize(
+                        mReceiverSessionID, params.mBatchSize);
+            }
+
+            if (err == OK) {
+                err = mNetSession->createUDPSession(
+                        params.mPort + 1, "127.0.0.1", params.mPort,
+                        senderNotify, &mSenderSessionID);
+            }
+
+            if (err == OK) {
+                Mutex::Autolock autoLock(mLock);
+                mSenderConnected = true;
+            }
+            break;
+        }
+
+        case kTransportTCPDatagram:
+        {
+            err = mNetSession->createTCPDatagramSession(
+                    addr, params.mPort, receiverNotify, &mServerSessionID);
+
+            if (err == OK) {
+                err = mNetSession->createTCPDatagramSession(
+                        params.mPort + 1, "127.0.0.1", params.mPort,
+                        senderNotify, &mSenderSessionID);
+            }
+            break;
+        }
+
+        case kTransportRTSPInterleaved:
+        {
+            err = mNetSession->createRTSPServer(
+                    addr, params.mPort, receiverNotify, &mServerSessionID);
+
+            if (err == OK) {
+                err = mNetSession->createRTSPClient(
+                        "127.0.0.1", params.mPort, senderNotify,
+                        &mSenderSessionID);
+            }
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+
+    if (err != OK) {
+        return err;
+    }
+
+    if (!waitFor(&SessionBench::isConnected, 5000000ll)) {
+        return -ETIMEDOUT;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+    return mError;
+}
+
+void SessionBench::tearDown() {
+    if (mSenderSessionID != 0) {
+        mNetSession->destroySession(mSenderSessionID);
+    }
+
+    if (mReceiverSessionID != 0) {
+        mNetSession->destroySession(mReceiverSessionID);
+    }
+
+    if (mServerSessionID != 0) {
+        mNetSession->destroySession(mServerSessionID);
+    }
+}
+
+void SessionBench::run(const BenchParams &params) {
+    size_t size = params.mPacketSize;
+    if (size < kPacketHeaderSize) {
+        size = kPacketHeaderSize;
+    }
+
+    int64_t intervalUs = size * 8ll * 1000000ll / params.mBitsPerSecond;
+    int64_t numPackets = params.mDurationUs / (intervalUs > 0 ? intervalUs : 1);
+
+    int64_t cpuStartUs = GetCPUTimeUs();
+    int64_t startUs = ALooper::GetNowUs();
+
+    int64_t numPacketsSent = 0ll;
+    for (int64_t i = 0; i < numPackets; ++i) {
+        int64_t nowUs = ALooper::GetNowUs();
+        int64_t dueUs = startUs + i * intervalUs;
+
+        if (nowUs < dueUs) {
+            usleep(dueUs - nowUs);
+            nowUs = ALooper::GetNowUs();
+        }
+
+        sp<ABuffer> packet = new ABuffer(size);
+        memset(packet->data(), 0, size);
+        WriteInt64(packet->data(), nowUs);
+        packet->data()[8] = (i >> 24) & 0xff;
+        packet->data()[9] = (i >> 16) & 0xff;
+        packet->data()[10] = (i >> 8) & 0xff;
+        packet->data()[11] = i & 0xff;
+
+        if (sendPacket(packet) == OK) {
+            ++numPacketsSent;
+        }
+    }
+
+    int64_t drainStartUs = ALooper::GetNowUs();
+
+    {
+        Mutex::Autolock autoLock(mLock);
+        while (mNumPacketsReceived < numPacketsSent
+                && ALooper::GetNowUs() < drainStartUs + kDrainTimeoutUs) {
+            mCondition.waitRelative(mLock, 10000000ll /* 10 ms */);
+        }
+    }
+
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+    int64_t cpuUs = GetCPUTimeUs() - cpuStartUs;
+
+    mNetSession->requestSessionStats(
+            mSenderSessionID, new AMessage(kWhatSenderStats, id()));
+
+    if (mReceiverSessionID != 0) {
+        mNetSession->requestSessionStats(
+                mReceiverSessionID, new AMessage(kWhatReceiverStats, id()));
+    }
+
+    waitFor(&SessionBench::haveStats, 1000000ll);
+
+    printResults(params, numPacketsSent, elapsedUs, cpuUs);
+}
+
+status_t SessionBench::sendPacket(const sp<ABuffer> &packet) {
+    if (mTransport == kTransportRTSPInterleaved) {
+        return mNetSession->sendInterleavedData(
+                mSenderSessionID, 0 /* channel */, packet);
+    }
+
+    return mNetSession->sendRequest(mSenderSessionID, packet);
+}
+
+void SessionBench::onPacket(const sp<ABuffer> &packet) {
+    if (packet->size() < kPacketHeaderSize) {
+        return;
+    }
+
+    int64_t latencyUs = ALooper::GetNowUs() - ReadInt64(packet->data());
+
+    Mutex::Autolock autoLock(mLock);
+    ++mNumPacketsReceived;
+    mNumBytesReceived += packet->size();
+    mLatenciesUs.push(latencyUs);
+    mCondition.broadcast();
+}
+
+bool SessionBench::waitFor(
+        bool (SessionBench::*condition)() const, int64_t timeoutUs) {
+    int64_t deadlineUs = ALooper::GetNowUs() + timeoutUs;
+
+    Mutex::Autolock autoLock(mLock);
+    while (!(this->*condition)()) {
+        int64_t nowUs = ALooper::GetNowUs();
+        if (nowUs >= deadlineUs) {
+            return false;
+        }
+
+        mCondition.waitRelative(mLock, (deadlineUs - nowUs) * 1000ll);
+    }
+
+    return true;
+}
+
+bool SessionBench::isConnected() const {
+    return mError != OK || (mSenderConnected && mReceiverSessionID != 0);
+}
+
+bool SessionBench::haveStats() const {
+    return mSenderStats != NULL
+        && (mReceiverSessionID == 0 || mReceiverStats != NULL);
+}
+
+void SessionBench::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatSenderNotify:
+        case kWhatReceiverNotify:
+        {
+            int32_t reason;
+            CHECK(msg->findInt32("reason", &reason));
+
+            int32_t sessionID;
+            CHECK(msg->findInt32("sessionID", &sessionID));
+
+            switch (reason) {
+                case ANetworkSession::kWhatError:
+                {
+                    int32_t err;
+                    CHECK(msg->findInt32("err", &err));
+
+                    AString detail;
+                    CHECK(msg->findString("detail", &detail));
+
+                    ALOGE("session %d encountered error %d (%s)",
+                          sessionID, err, detail.c_str());
+
+                    Mutex::Autolock autoLock(mLock);
+                    if (mError == OK) {
+                        mError = err;
+                    }
+                    mCondition.broadcast();
+                    break;
+                }
+
+                case ANetworkSession::kWhatConnected:
+                {
+                    Mutex::Autolock autoLock(mLock);
+                    mSenderConnected = true;
+                    mCondition.broadcast();
+                    break;
+                }
+
+                case ANetworkSession::kWhatClientConnected:
+                {
+                    Mutex::Autolock autoLock(mLock);
+                    mReceiverSessionID = sessionID;
+                    mCondition.broadcast();
+                    break;
+                }
+
+                case ANetworkSession::kWhatDatagram:
+                case ANetworkSession::kWhatBinaryData:
+                {
+                    sp<ABuffer> data;
+                    CHECK(msg->findBuffer("data", &data));
+
+                    onPacket(data);
+                    break;
+                }
+
+                case ANetworkSession::kWhatDatagramBatch:
+                {
+                    sp<RefBase> obj;
+                    CHECK(msg->findObject("packets", &obj));
+
+                    sp<ANetworkSession::DatagramBatch> batch =
+                        static_cast<ANetworkSession::DatagramBatch *>(
+                                obj.get());
+
+                    for (size_t i = 0; i < batch->mPackets.size(); ++i) {
+                        onPacket(batch->mPackets.itemAt(i));
+                    }
+                    break;
+                }
+
+                default:
+                    break;
+            }
+            break;
+        }
+
+        case kWhatSenderStats:
+        case kWhatReceiverStats:
+        {
+            Mutex::Autolock autoLock(mLock);
+
+            if (msg->what() == kWhatSenderStats) {
+                mSenderStats = msg;
+            } else {
+                mReceiverStats = msg;
+            }
+
+            mCondition.broadcast();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+static int64_t FindStat(const sp<AMessage> &stats, const char *name) {
+    int64_t value;
+    if (stats == NULL || !stats->findInt64(name, &value)) {
+        return -1ll;
+    }
+
+    return value;
+}
+
+void SessionBench::printResults(
+        const BenchParams &params,
+        int64_t numPacketsSent, int64_t elapsedUs, int64_t cpuUs) {
+    Mutex::Autolock autoLock(mLock);
+
+    mLatenciesUs.sort(CompareInt64);
+
+    int64_t numReceived = mNumPacketsReceived;
+
+    printf("{\"benchmark\":\"session\",\"transport\":\"%s\","
+           "\"packetSize\":%d,\"rateBps\":%lld,\"threads\":%d,"
+           "\"packetsSent\":%lld,\"packetsReceived\":%lld,"
+           "\"bytesReceived\":%lld,\"packetsPerSec\":%lld,"
+           "\"cpuUsPerPacket\":%.3f,"
+           "\"latencyP50Us\":%lld,\"latencyP99Us\":%lld,"
+           "\"latencyP999Us\":%lld,\"latencyMaxUs\":%lld,"
+           "\"sendAllocations\":%lld,\"senderQueueHighWaterMark\":%lld,"
+           "\"receivePoolMisses\":%lld}\n",
+           TransportName(mTransport),
+           (int)params.mPacketSize,
+           params.mBitsPerSecond,
+           (int)params.mNumThreads,
+           numPacketsSent,
+           numReceived,
+           mNumBytesReceived,
+           elapsedUs > 0 ? numReceived * 1000000ll / elapsedUs : 0ll,
+           numReceived > 0 ? (double)cpuUs / numReceived : 0.0,
+           Percentile(mLatenciesUs, 50.0),
+           Percentile(mLatenciesUs, 99.0),
+           Percentile(mLatenciesUs, 99.9),
+           mLatenciesUs.isEmpty() ? 0ll : mLatenciesUs.top(),
+           FindStat(mSenderStats, "sendAllocations"),
+           FindStat(mSenderStats, "queueHighWaterMark"),
+           FindStat(mReceiverStats, "poolMisses"));
+
+    fflush(stdout);
+}
+
+static status_t RunSessionBench(
+        SessionBench::Transport transport, const BenchParams &params) {
+    sp<ANetworkSession> netSession = new ANetworkSession(params.mNumThreads);
+    netSession->start();
+
+    sp<ALooper> looper = new ALooper;
+    looper->setName("netbench");
+    looper->start();
+
+    sp<SessionBench> bench = new SessionBench(netSession, transport);
+    looper->registerHandler(bench);
+
+    status_t err = bench->setUp(params);
+
+    if (err == OK) {
+        bench->run(params);
+    } else {
+        fprintf(stderr, "unable to set up %s sessions (%d)\n",
+                SessionBench::TransportName(transport), err);
+    }
+
+    bench->tearDown();
+
+    looper->unregisterHandler(bench->id());
+    looper->stop();
+
+    netSession->stop();
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Same layout as the kernel's struct mmsghdr, which the C library doesn't
+// necessarily declare.
+struct MultiMessage {
+    struct msghdr mHeader;
+    unsigned int mLength;
+};
+
+// Reads and counts whatever arrives on a socket until asked to exit.
+struct DrainThread : public Thread {
+    DrainThread(int s)
+        : mSocket(s),
+          mNumPacketsReceived(0) {
+    }
+
+    int32_t numPacketsReceived() const {
+        return android_atomic_acquire_load(&mNumPacketsReceived);
+    }
+
+protected:
+    virtual ~DrainThread() {}
+
+private:
+    int mSocket;
+    volatile int32_t mNumPacketsReceived;
+
+    virtual bool threadLoop() {
+        uint8_t buffer[65536];
+
+        // The socket has a receive timeout so that exit requests are noticed.
+        ssize_t n = recv(mSocket, buffer, sizeof(buffer), 0);
+
+        if (n >= 0) {
+            android_atomic_inc(&mNumPacketsReceived);
+        }
+
+        return true;
+    }
+
+    DISALLOW_EVIL_CONSTRUCTORS(DrainThread);
+};
+
+// Compares ways of writing a batch of equally sized datagrams to a
+// connected UDP socket: one send() per datagram, one sendmmsg() per batch
+// and sendmmsg() with UDP GSO, every message then carrying a run of
+// datagrams the kernel segments.
+struct SendBench {
+    enum Method {
+        kMethodSend,
+        kMethodSendmmsg,
+        kMethodSendmmsgGSO,
+    };
+
+    static const char *MethodName(Method method);
+
+    static status_t Run(Method method, const BenchParams &params);
+
+private:
+    // Number of datagrams written per round.
+    static const size_t kDefaultBatchSize = 64;
+
+    // Kernel limits for a single UDP GSO send.
+    static const size_t kMaxGSOSegments = 64;
+    static const size_t kMaxGSOSize = 65507;
+
+    static status_t MakeSockets(unsigned port, int *sender, int *receiver);
+
+    // Returns the number of datagrams written, or a negative error.
+    static ssize_t SendBatch(
+            Method method, int s,
+            const uint8_t *data, size_t size, size_t batchSize);
+
+    DISALLOW_EVIL_CONSTRUCTORS(SendBench);
+};
+
+// static
+const char *SendBench::MethodName(Method method) {
+    switch (method) {
+        case kMethodSend:
+            return "send";
+        case kMethodSendmmsg:
+            return "sendmmsg";
+        case kMethodSendmmsgGSO:
+            return "sendmmsg+gso";
+        default:
+            TRESPASS();
+    }
+
+    return NULL;
+}
+
+// static
+status_t SendBench::MakeSockets(unsigned port, int *sender, int *receiver) {
+    *sender = *receiver = -1;
+
+    int r = socket(AF_INET, SOCK_DGRAM, 0);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+    status_t err = OK;
+    if (r < 0 || s < 0) {
+        err = -errno;
+    }
+
+    struct sockaddr_in addr;
+    memset(addr.sin_zero, 0, sizeof(addr.sin_zero));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (err == OK) {
+        int size = 4 * 1024 * 1024;
+        setsockopt(r, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        setsockopt(r, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        if (bind(r, (const struct sockaddr *)&addr, sizeof(addr)) < 0
+                || connect(s, (const struct sockaddr *)&addr,
+                           sizeof(addr)) < 0) {
+            err = -errno;
+        }
+    }
+
+    if (err != OK) {
+        if (r >= 0) {
+            close(r);
+        }
+
+        if (s >= 0) {
+            close(s);
+        }
+
+        return err;
+    }
+
+    *sender = s;
+    *receiver = r;
+
+    return OK;
+}
+
+// static
+ssize_t SendBench::SendBatch(
+        Method method, int s,
+        const uint8_t *data, size_t size, size_t batchSize) {
+    if (method == kMethodSend) {
+        size_t i = 0;
+        while (i < batchSize) {
+            ssize_t n = send(s, data, size, 0);
+
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return (i > 0) ? (ssize_t)i : -errno;
+            }
+
+            ++i;
+        }
+
+        return i;
+    }
+
+#ifdef __NR_sendmmsg
+    size_t segmentsPerMessage = 1;
+
+#ifdef UDP_SEGMENT
+    union {
+        char mData[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr mAlign;
+    } control;
+
+    if (method == kMethodSendmmsgGSO) {
+        segmentsPerMessage = kMaxGSOSize / size;
+        if (segmentsPerMessage > kMaxGSOSegments) {
+            segmentsPerMessage = kMaxGSOSegments;
+        }
+    }
+#else
+    if (method == kMethodSendmmsgGSO) {
+        return -ENOSYS;
+    }
+#endif
+
+    // Every datagram of the batch points at the same payload.
+    Vector<struct iovec> iovs;
+    iovs.resize(batchSize);
+    for (size_t i = 0; i < batchSize; ++i) {
+        iovs.editItemAt(i).iov_base = const_cast<uint8_t *>(data);
+        iovs.editItemAt(i).iov_len = size;
+    }
+
+    size_t numMsgs =
+        (batchSize + segmentsPerMessage - 1) / segmentsPerMessage;
+
+    Vector<MultiMessage> msgs;
+    msgs.resize(numMsgs);
+
+    for (size_t i = 0; i < numMsgs; ++i) {
+        MultiMessage *msg = &msgs.editItemAt(i);
+        memset(msg, 0, sizeof(*msg));
+
+        size_t first = i * segmentsPerMessage;
+        size_t count = batchSize - first;
+        if (count > segmentsPerMessage) {
+            count = segmentsPerMessage;
+        }
+
+        msg->mHeader.msg_iov = &iovs.editItemAt(first);
+        msg->mHeader.msg_iovlen = count;
+
+#ifdef UDP_SEGMENT
+        if (count > 1) {
+            // All messages share the same segment size.
+            msg->mHeader.msg_control = control.mData;
+            msg->mHeader.msg_controllen = sizeof(control.mData);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg->mHeader);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cmsg) = size;
+        }
+#endif
+    }
+
+    size_t numSent = 0;
+    size_t msgIndex = 0;
+    while (msgIndex < numMsgs) {
+        int n = syscall(
+                __NR_sendmmsg, s, &msgs.editItemAt(msgIndex),
+                numMsgs - msgIndex, 0);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (numSent > 0) ? (ssize_t)numSent : -errno;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            numSent += msgs.itemAt(msgIndex + i).mHeader.msg_iovlen;
+        }
+
+        msgIndex += n;
+    }
+
+    return numSent;
+#else
+    return -ENOSYS;
+#endif
+}
+
+// static
+status_t SendBench::Run(Method method, const BenchParams &params) {
+    size_t size = params.mPacketSize;
+    if (size == 0) {
+        size = 1;
+    }
+
+    size_t batchSize = params.mBatchSize;
+    if (batchSize == 0) {
+        batchSize = kDefaultBatchSize;
+    }
+
+    int s, r;
+    status_t err = MakeSockets(params.mPort, &s, &r);
+    if (err != OK) {
+        fprintf(stderr, "unable to create sockets (%d)\n", err);
+        return err;
+    }
+
+    sp<DrainThread> drainThread = new DrainThread(r);
+    drainThread->run("netbench drain", ANDROID_PRIORITY_AUDIO);
+
+    Vector<uint8_t> payload;
+    payload.insertAt((uint8_t)0, 0, size);
+
+    int64_t numPacketsSent = 0ll;
+    int64_t numErrors = 0ll;
+
+    // Leave out the time spent by the drain thread where possible.
+#ifdef RUSAGE_THREAD
+    int who = RUSAGE_THREAD;
+#else
+    int who = RUSAGE_SELF;
+#endif
+
+    int64_t cpuStartUs = GetCPUTimeUs(who);
+    int64_t startUs = ALooper::GetNowUs();
+    int64_t nowUs = startUs;
+
+    while (nowUs < startUs + params.mDurationUs) {
+        ssize_t n = SendBatch(method, s, payload.array(), size, batchSize);
+
+        if (n == -ENOSYS || n == -EIO || n == -EINVAL || n == -ENOPROTOOPT) {
+            // The kernel lacks sendmmsg() or UDP GSO.
+            err = n;
+            break;
+        } else if (n < 0) {
+            // ENOBUFS and friends, the receiver is falling behind.
+            ++numErrors;
+        } else {
+            numPacketsSent += n;
+        }
+
+        nowUs = ALooper::GetNowUs();
+    }
+
+    int64_t elapsedUs = nowUs - startUs;
+    int64_t cpuUs = GetCPUTimeUs(who) - cpuStartUs;
+
+    // Let the receiver catch up before counting.
+    usleep(100000);
+
+    drainThread->requestExit();
+    drainThread->requestExitAndWait();
+
+    close(s);
+    close(r);
+
+    printf("{\"benchmark\":\"send\",\"method\":\"%s\",\"supported\":%s,"
+           "\"packetSize\":%d,\"batchSize\":%d,"
+           "\"packetsSent\":%lld,\"packetsReceived\":%d,\"sendErrors\":%lld,"
+           "\"packetsPerSec\":%lld,\"cpuUsPerPacket\":%.3f}\n",
+           MethodName(method),
+           err == OK ? "true" : "false",
+           (int)size,
+           (int)batchSize,
+           numPacketsSent,
+           drainThread->numPacketsReceived(),
+           numErrors,
+           elapsedUs > 0 ? numPacketsSent * 1000000ll / elapsedUs : 0ll,
+           numPacketsSent > 0 ? (double)cpuUs / numPacketsSent : 0.0);
+
+    fflush(stdout);
+
+    // An unsupported method is reported, not treated as a failure.
+    return OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Writes a stream of framed packets, '$'-framed interleaved data for RTSP
+// or 16-bit length-prefixed datagrams otherwise, into the server side of
+// an ANetworkSession connection from a plain socket. Packets are written
+// in bursts of several at a time, the way a sender's TCP stack delivers
+// them, to exercise the session's stream parser.
+struct ParserBench : public AHandler {
+    ParserBench(const sp<ANetworkSession> &netSession, bool interleaved);
+
+    status_t setUp(const BenchParams &params);
+    void run(const BenchParams &params);
+    void tearDown();
+
+protected:
+    virtual ~ParserBench();
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatServerNotify,
+        kWhatStats,
+    };
+
+    // Packets per write unless overridden.
+    static const size_t kDefaultBurstSize = 48;
+
+    sp<ANetworkSession> mNetSession;
+    bool mInterleaved;
+    int mSocket;
+
+    Mutex mLock;
+    Condition mCondition;
+
+    int32_t mServerSessionID;
+    int32_t mSessionID;
+    status_t mError;
+
+    int64_t mNumPacketsReceived;
+    Vector<int64_t> mLatenciesUs;
+
+    sp<AMessage> mStats;
+
+    status_t writeFully(const uint8_t *data, size_t size);
+
+    DISALLOW_EVIL_CONSTRUCTORS(ParserBench);
+};
+
+ParserBench::ParserBench(
+        const sp<ANetworkSession> &netSession, bool interleaved)
+    : mNetSession(netSession),
+      mInterleaved(interleaved),
+      mSocket(-1),
+      mServerSessionID(0),
+      mSessionID(0),
+      mError(OK),
+      mNumPacketsReceived(0ll) {
+}
+
+ParserBench::~ParserBench() {
+}
+
+status_t ParserBench::setUp(const BenchParams &params) {
+    sp<AMessage> notify = new AMessage(kWhatServerNotify, id());
+
+    struct in_addr addr;
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    status_t err;
+    if (mInterleaved) {
+        err = mNetSession->createRTSPServer(
+                addr, params.mPort, notify, &mServerSessionID);
+    } else {
+        err = mNetSession->createTCPDatagramSession(
+                addr, params.mPort, notify, &mServerSessionID);
+    }
+
+    if (err != OK) {
+        return err;
+    }
+
+    mSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (mSocket < 0) {
+        return -errno;
+    }
+
+    struct sockaddr_in remoteAddr;
+    memset(remoteAddr.sin_zero, 0, sizeof(remoteAddr.sin_zero));
+    remoteAddr.sin_family = AF_INET;
+    remoteAddr.sin_addr = addr;
+    remoteAddr.sin_port = htons(params.mPort);
+
+    if (connect(mSocket, (const struct sockaddr *)&remoteAddr,
+                sizeof(remoteAddr)) < 0) {
+        return -errno;
+    }
+
+    int flag = 1;
+    setsockopt(mSocket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    int64_t deadlineUs = ALooper::GetNowUs() + 5000000ll;
+
+    Mutex::Autolock autoLock(mLock);
+    while (mSessionID == 0 && mError == OK) {
+        int64_t nowUs = ALooper::GetNowUs();
+        if (nowUs >= deadlineUs) {
+            return -ETIMEDOUT;
+        }
+
+        mCondition.waitRelative(mLock, (deadlineUs - nowUs) * 1000ll);
+    }
+
+    return mError;
+}
+
+void ParserBench::tearDown() {
+    if (mSocket >= 0) {
+        close(mSocket);
+        mSocket = -1;
+    }
+
+    if (mSessionID != 0) {
+        mNetSession->destroySession(mSessionID);
+    }
+
+    if (mServerSessionID != 0) {
+        mNetSession->destroySession(mServerSessionID);
+    }
+}
+
+status_t ParserBench::writeFully(const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(mSocket, data, size, 0);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -errno;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return OK;
+}
+
+void ParserBench::run(const BenchParams &params) {
+    size_t size = params.mPacketSize;
+    if (size < kPacketHeaderSize) {
+        size = kPacketHeaderSize;
+    } else if (size > 0xffff) {
+        size = 0xffff;
+    }
+
+    size_t burstSize = params.mBatchSize;
+    if (burstSize == 0) {
+        burstSize = kDefaultBurstSize;
+    }
+
+    size_t headerSize = mInterleaved ? 4 : 2;
+    size_t frameSize = headerSize + size;
+
+    int64_t intervalUs =
+        burstSize * frameSize * 8ll * 1000000ll / params.mBitsPerSecond;
+
+    int64_t numBursts =
+        params.mDurationUs / (intervalUs > 0 ? intervalUs : 1);
+
+    Vector<uint8_t> burst;
+    burst.resize(burstSize * frameSize);
+    memset(burst.editArray(), 0, burst.size());
+
+    for (size_t i = 0; i < burstSize; ++i) {
+        uint8_t *frame = burst.editArray() + i * frameSize;
+
+        if (mInterleaved) {
+            frame[0] = '$';
+            frame[1] = 0;  // channel
+            frame[2] = size >> 8;
+            frame[3] = size & 0xff;
+        } else {
+            frame[0] = size >> 8;
+            frame[1] = size & 0xff;
+        }
+    }
+
+    int64_t cpuStartUs = GetCPUTimeUs();
+    int64_t startUs = ALooper::GetNowUs();
+
+    int64_t numPacketsSent = 0ll;
+    status_t err = OK;
+    for (int64_t i = 0; i < numBursts && err == OK; ++i) {
+        int64_t nowUs = ALooper::GetNowUs();
+        int64_t dueUs = startUs + i * intervalUs;
+
+        if (nowUs < dueUs) {
+            usleep(dueUs - nowUs);
+            nowUs = ALooper::GetNowUs();
+        }
+
+        for (size_t j = 0; j < burstSize; ++j) {
+            WriteInt64(burst.editArray() + j * frameSize + headerSize, nowUs);
+        }
+
+        err = writeFully(burst.array(), burst.size());
+
+        if (err == OK) {
+            numPacketsSent += burstSize;
+        }
+    }
+
+    if (err != OK) {
+        ALOGE("writing the stream failed (%s)", strerror(-err));
+    }
+
+    int64_t drainStartUs = ALooper::GetNowUs();
+
+    {
+        Mutex::Autolock autoLock(mLock);
+        while (mNumPacketsReceived < numPacketsSent
+                && ALooper::GetNowUs() < drainStartUs + kDrainTimeoutUs) {
+            mCondition.waitRelative(mLock, 10000000ll /* 10 ms */);
+        }
+    }
+
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+    int64_t cpuUs = GetCPUTimeUs() - cpuStartUs;
+
+    mNetSession->requestSessionStats(
+            mSessionID, new AMessage(kWhatStats, id()));
+
+    Mutex::Autolock autoLock(mLock);
+
+    int64_t deadlineUs = ALooper::GetNowUs() + 1000000ll;
+    while (mStats == NULL && ALooper::GetNowUs() < deadlineUs) {
+        mCondition.waitRelative(mLock, 10000000ll /* 10 ms */);
+    }
+
+    mLatenciesUs.sort(CompareInt64);
+
+    int64_t numReceived = mNumPacketsReceived;
+    int64_t numBytes = numReceived * frameSize;
+
+    printf("{\"benchmark\":\"parser\",\"framing\":\"%s\","
+           "\"packetSize\":%d,\"burstSize\":%d,\"rateBps\":%lld,"
+           "\"packetsSent\":%lld,\"packetsReceived\":%lld,"
+           "\"packetsPerSec\":%lld,\"bitsPerSec\":%lld,"
+           "\"cpuUsPerPacket\":%.3f,"
+           "\"latencyP50Us\":%lld,\"latencyP99Us\":%lld,"
+           "\"latencyP999Us\":%lld,\"latencyMaxUs\":%lld,"
+           "\"poolMisses\":%lld}\n",
+           mInterleaved ? "interleaved" : "datagram",
+           (int)size,
+           (int)burstSize,
+           params.mBitsPerSecond,
+           numPacketsSent,
+           numReceived,
+           elapsedUs > 0 ? numReceived * 1000000ll / elapsedUs : 0ll,
+           elapsedUs > 0 ? numBytes * 8ll * 1000000ll / elapsedUs : 0ll,
+           numReceived > 0 ? (double)cpuUs / numReceived : 0.0,
+           Percentile(mLatenciesUs, 50.0),
+           Percentile(mLatenciesUs, 99.0),
+           Percentile(mLatenciesUs, 99.9),
+           mLatenciesUs.isEmpty() ? 0ll : mLatenciesUs.top(),
+           FindStat(mStats, "poolMisses"));
+
+    fflush(stdout);
+}
+
+void ParserBench::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatServerNotify:
+        {
+            int32_t reason;
+            CHECK(msg->findInt32("reason", &reason));
+
+            int32_t sessionID;
+            CHECK(msg->findInt32("sessionID", &sessionID));
+
+            switch (reason) {
+                case ANetworkSession::kWhatError:
+                {
+                    int32_t err;
+                    CHECK(msg->findInt32("err", &err));
+
+                    AString detail;
+                    CHECK(msg->findString("detail", &detail));
+
+                    ALOGE("session %d encountered error %d (%s)",
+                          sessionID, err, detail.c_str());
+
+                    Mutex::Autolock autoLock(mLock);
+                    if (mError == OK) {
+                        mError = err;
+                    }
+                    mCondition.broadcast();
+                    break;
+                }
+
+                case ANetworkSession::kWhatClientConnected:
+                {
+                    Mutex::Autolock autoLock(mLock);
+                    mSessionID = sessionID;
+                    mCondition.broadcast();
+                    break;
+                }
+
+                case ANetworkSession::kWhatDatagram:
+                case ANetworkSession::kWhatBinaryData:
+                {
+                    sp<ABuffer> data;
+                    CHECK(msg->findBuffer("data", &data));
+
+                    if (data->size() < kPacketHeaderSize) {
+                        break;
+                    }
+
+                    int64_t latencyUs =
+                        ALooper::GetNowUs() - ReadInt64(data->data());
+
+                    Mutex::Autolock autoLock(mLock);
+                    ++mNumPacketsReceived;
+                    mLatenciesUs.push(latencyUs);
+                    mCondition.broadcast();
+                    break;
+                }
+
+                default:
+                    break;
+            }
+            break;
+        }
+
+        case kWhatStats:
+        {
+            Mutex::Autolock autoLock(mLock);
+            mStats = msg;
+            mCondition.broadcast();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+static status_t RunParserBench(bool interleaved, const BenchParams &params) {
+    sp<ANetworkSession> netSession = new ANetworkSession(params.mNumThreads);
+    netSession->start();
+
+    sp<ALooper> looper = new ALooper;
+    looper->setName("netbench");
+    looper->start();
+
+    sp<ParserBench> bench = new ParserBench(netSession, interleaved);
+    looper->registerHandler(bench);
+
+    status_t err = bench->setUp(params);
+
+    if (err == OK) {
+        bench->run(params);
+    } else {
+        fprintf(stderr, "unable to set up the %s stream (%d)\n",
+                interleaved ? "interleaved" : "datagram", err);
+    }
+
+    bench->tearDown();
+
+    looper->unregisterHandler(bench->id());
+    looper->stop();
+
+    netSession->stop();
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Replays a simulated RTP stream with random loss and reordering through a
+// JitterBuffer, answering retransmission requests, and measures the time
+// spent in it along with the delay it adds. Runs on a simulated clock, as
+// fast as possible.
+struct JitterBench {
+    static status_t Run(const BenchParams &params);
+
+private:
+    // Resolution of the simulated clock, and the interval at which the
+    // player asks for data.
+    static const int64_t kTickUs = 100ll;
+    static const int64_t kDequeueIntervalUs = 1000ll;
+
+    // Retransmissions arrive this long after they were requested, unless
+    // lost themselves.
+    static const int64_t kRetransmitDelayUs = 2000ll;
+
+    // Reordered packets are delayed by up to this many packet intervals.
+    static const int64_t kMaxReorderDistance = 4ll;
+
+    // Number of buckets of the timing wheel holding packets in flight, has
+    // to cover the longest delay.
+    static const size_t kNumBuckets = 4096;
+
+    DISALLOW_EVIL_CONSTRUCTORS(JitterBench);
+};
+
+// static
+status_t JitterBench::Run(const BenchParams &params) {
+    size_t size = params.mPacketSize;
+    if (size == 0) {
+        size = 1;
+    }
+
+    int64_t intervalUs = size * 8ll * 1000000ll / params.mBitsPerSecond;
+    if (intervalUs < 1ll) {
+        intervalUs = 1ll;
+    }
+
+    int64_t numPackets = params.mDurationUs / intervalUs;
+
+    if (kMaxReorderDistance * intervalUs >= (int64_t)kNumBuckets * kTickUs
+            || kRetransmitDelayUs >= (int64_t)kNumBuckets * kTickUs) {
+        fprintf(stderr, "packet interval too long for the simulation\n");
+        return -EINVAL;
+    }
+
+    // Packets in flight, by the tick they arrive at.
+    Vector<Vector<int32_t> > buckets;
+    buckets.resize(kNumBuckets);
+
+    JitterBuffer jitterBuffer;
+    Vector<int64_t> delaysUs;
+
+    uint32_t seed = 1;
+    int64_t numDelivered = 0ll;
+    int64_t timeInBufferNs = 0ll;
+
+    int64_t cpuStartUs = GetCPUTimeUs();
+
+    int64_t endUs = params.mDurationUs + 1000000ll;
+    int64_t nextExtSeqNo = 0ll;
+
+    for (int64_t nowUs = 0ll; nowUs < endUs; nowUs += kTickUs) {
+        // Send whatever is due.
+        while (nextExtSeqNo < numPackets
+                && nextExtSeqNo * intervalUs <= nowUs) {
+            int32_t extSeqNo = nextExtSeqNo++;
+
+            seed = seed * 1103515245 + 12345;
+            double r = ((seed >> 8) % 1000000) / 10000.0;
+
+            if (extSeqNo > 0 && r < params.mLossPercent) {
+                continue;
+            }
+
+            int64_t arrivalUs = nowUs;
+            if (extSeqNo > 0
+                    && r < params.mLossPercent + params.mReorderPercent) {
+                arrivalUs += (1 + seed % kMaxReorderDistance) * intervalUs;
+            }
+
+            buckets.editItemAt((arrivalUs / kTickUs) % kNumBuckets)
+                .push(extSeqNo);
+        }
+
+        Vector<int32_t> &arrivals =
+            buckets.editItemAt((nowUs / kTickUs) % kNumBuckets);
+
+        Vector<int32_t> nacks;
+
+        for (size_t i = 0; i < arrivals.size(); ++i) {
+            int32_t extSeqNo = arrivals.itemAt(i);
+
+            sp<ABuffer> buffer = new ABuffer(size);
+            buffer->setInt32Data(extSeqNo);
+
+            buffer->meta()->setInt32(
+                    "rtp-time", (extSeqNo * intervalUs * 9ll) / 100ll);
+
+            buffer->meta()->setInt64("arrivalTimeUs", nowUs);
+
+            nsecs_t startNs = systemTime(SYSTEM_TIME_MONOTONIC);
+            jitterBuffer.queueBuffer(buffer, nowUs, &nacks);
+            timeInBufferNs += systemTime(SYSTEM_TIME_MONOTONIC) - startNs;
+        }
+
+        arrivals.clear();
+
+        if ((nowUs % kDequeueIntervalUs) == 0ll) {
+            for (;;) {
+                nsecs_t startNs = systemTime(SYSTEM_TIME_MONOTONIC);
+                sp<ABuffer> buffer = jitterBuffer.dequeueBuffer(nowUs, &nacks);
+                timeInBufferNs += systemTime(SYSTEM_TIME_MONOTONIC) - startNs;
+
+                if (buffer == NULL) {
+                    break;
+                }
+
+                ++numDelivered;
+                delaysUs.push(nowUs - buffer->int32Data() * intervalUs);
+            }
+        }
+
+        // Answer the requests, extending their 16 bit sequence numbers
+        // relative to the last packet sent.
+        int32_t lastExtSeqNo = nextExtSeqNo - 1;
+
+        for (size_t i = 0; i < nacks.size(); ++i) {
+            int32_t extSeqNo = (lastExtSeqNo & ~0xffff) | nacks.itemAt(i);
+            if (extSeqNo > lastExtSeqNo) {
+                extSeqNo -= 0x10000;
+            }
+
+            seed = seed * 1103515245 + 12345;
+            double r = ((seed >> 8) % 1000000) / 10000.0;
+
+            if (r < params.mLossPercent) {
+                continue;
+            }
+
+            int64_t arrivalUs = nowUs + kRetransmitDelayUs;
+            buckets.editItemAt((arrivalUs / kTickUs) % kNumBuckets)
+                .push(extSeqNo);
+        }
+    }
+
+    int64_t cpuUs = GetCPUTimeUs() - cpuStartUs;
+
+    sp<AMessage> stats = new AMessage;
+    jitterBuffer.getStats(stats);
+
+    delaysUs.sort(CompareInt64);
+
+    printf("{\"benchmark\":\"jitter\",\"packets\":%lld,"
+           "\"lossPercent\":%.2f,\"reorderPercent\":%.2f,"
+           "\"delivered\":%lld,\"dropped\":%lld,\"late\":%lld,"
+           "\"duplicates\":%lld,\"nacksSent\":%lld,\"nacksRecovered\":%lld,"
+           "\"nsPerPacket\":%.1f,\"cpuUsPerPacket\":%.3f,"
+           "\"delayP50Us\":%lld,\"delayP99Us\":%lld,\"delayP999Us\":%lld,"
+           "\"delayMaxUs\":%lld}\n",
+           numPackets,
+           params.mLossPercent,
+           params.mReorderPercent,
+           numDelivered,
+           FindStat(stats, "packetsDropped"),
+           FindStat(stats, "packetsLate"),
+           FindStat(stats, "packetsDuplicate"),
+           FindStat(stats, "nacksSent"),
+           FindStat(stats, "nacksRecovered"),
+           numPackets > 0 ? (double)timeInBufferNs / numPackets : 0.0,
+           numPackets > 0 ? (double)cpuUs / numPackets : 0.0,
+           Percentile(delaysUs, 50.0),
+           Percentile(delaysUs, 99.0),
+           Percentile(delaysUs, 99.9),
+           delaysUs.isEmpty() ? 0ll : delaysUs.top());
+
+    fflush(stdout);
+
+    return OK;
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m mode       session (default) runs pairs of ANetworkSession\n"
+            "                sessions, send compares the UDP send paths,\n"
+            "                parser streams framed packets into a session,\n"
+            "                jitter replays a lossy stream through the sink's\n"
+            "                JitterBuffer\n"
+            "  -t which      session mode: udp, tcp, rtsp or all (default)\n"
+            "                send mode: send, sendmmsg, sendmmsg+gso or all\n"
+            "                parser mode: interleaved, datagram or all\n"
+            "  -s bytes      packet size (1316)\n"
+            "  -r bps        send rate in bits per second (20000000, 50000000\n"
+            "                in parser mode), the send mode runs flat out\n"
+            "  -d secs       duration of each run (5)\n"
+            "  -p port       first local port to use (19000)\n"
+            "  -n threads    network threads (1)\n"
+            "  -b packets    UDP receive batch size (off) in session mode,\n"
+            "                datagrams per write round (64) in send mode,\n"
+            "                packets per write (48) in parser mode\n"
+            "  -l percent    jitter mode: packets lost (1)\n"
+            "  -o percent    jitter mode: packets reordered (5)\n"
+            "Prints one JSON object per run on stdout.\n",
+            me);
+}
+
+static bool Selected(const android::AString &which, const char *name) {
+    return !strcmp(which.c_str(), "all") || !strcmp(which.c_str(), name);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    BenchParams params;
+    AString mode = "session";
+    AString which = "all";
+    bool haveRate = false;
+
+    int res;
+    while ((res = getopt(argc, argv, "hm:t:s:r:d:p:n:b:l:o:")) >= 0) {
+        switch (res) {
+            case 'm':
+                mode = optarg;
+                break;
+
+            case 't':
+                which = optarg;
+                break;
+
+            case 's':
+                params.mPacketSize = atoi(optarg);
+                break;
+
+            case 'r':
+                params.mBitsPerSecond = atoll(optarg);
+                haveRate = true;
+                break;
+
+            case 'd':
+                params.mDurationUs = atoll(optarg) * 1000000ll;
+                break;
+
+            case 'p':
+                params.mPort = atoi(optarg);
+                break;
+
+            case 'n':
+                params.mNumThreads = atoi(optarg);
+                break;
+
+            case 'b':
+                params.mBatchSize = atoi(optarg);
+                break;
+
+            case 'l':
+                params.mLossPercent = atof(optarg);
+                break;
+
+            case 'o':
+                params.mReorderPercent = atof(optarg);
+                break;
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (params.mBitsPerSecond <= 0ll
+            || params.mNumThreads == 0
+            || params.mPacketSize > 65000) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    bool ranAny = false;
+
+    if (!strcmp(mode.c_str(), "session")) {
+        static const SessionBench::Transport kTransports[] = {
+            SessionBench::kTransportUDP,
+            SessionBench::kTransportTCPDatagram,
+            SessionBench::kTransportRTSPInterleaved,
+        };
+
+        size_t numTransports = sizeof(kTransports) / sizeof(kTransports[0]);
+        for (size_t i = 0; i < numTransports; ++i) {
+            if (!Selected(
+                        which, SessionBench::TransportName(kTransports[i]))) {
+                continue;
+            }
+
+            ranAny = true;
+
+            if (RunSessionBench(kTransports[i], params) != OK) {
+                return 1;
+            }
+
+            // Keep the next run clear of sockets lingering in TIME_WAIT.
+            params.mPort += 2;
+        }
+    } else if (!strcmp(mode.c_str(), "send")) {
+        static const SendBench::Method kMethods[] = {
+            SendBench::kMethodSend,
+            SendBench::kMethodSendmmsg,
+            SendBench::kMethodSendmmsgGSO,
+        };
+
+        size_t numMethods = sizeof(kMethods) / sizeof(kMethods[0]);
+        for (size_t i = 0; i < numMethods; ++i) {
+            if (!Selected(which, SendBench::MethodName(kMethods[i]))) {
+                continue;
+            }
+
+            ranAny = true;
+
+            if (SendBench::Run(kMethods[i], params) != OK) {
+                return 1;
+            }
+
+            ++params.mPort;
+        }
+    } else if (!strcmp(mode.c_str(), "parser")) {
+        if (!haveRate) {
+            params.mBitsPerSecond = 50000000ll;
+        }
+
+        for (size_t i = 0; i < 2; ++i) {
+            bool interleaved = (i == 0);
+
+            if (!Selected(which, interleaved ? "interleaved" : "datagram")) {
+                continue;
+            }
+
+            ranAny = true;
+
+            if (RunParserBench(interleaved, params) != OK) {
+                return 1;
+            }
+
+            ++params.mPort;
+        }
+    } else if (!strcmp(mode.c_str(), "jitter")) {
+        ranAny = true;
+
+        if (JitterBench::Run(params) != OK) {
+            return 1;
+        }
+    }
+
+    if (!ranAny) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    return 0;
+}
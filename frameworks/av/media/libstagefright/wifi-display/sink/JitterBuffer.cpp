@@ -0,0 +1,443 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "JitterBuffer"
+#include <utils/Log.h>
+
+#include "JitterBuffer.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+namespace android {
+
+// Clock rate of the RTP timestamps of the MPEG2 transport stream.
+static const int64_t kRTPClockRateHz = 90000ll;
+
+// A missing packet is waited for kJitterMultiplier times the current jitter
+// estimate, clamped to [kMinTargetDelayUs, kMaxTargetDelayUs]. Until there is
+// an estimate we wait kDefaultTargetDelayUs. If its retransmission has been
+// requested we wait for that as well, up to kMaxTargetDelayUs after the
+// packet was found missing.
+static const int64_t kJitterMultiplier = 4ll;
+static const int64_t kMinTargetDelayUs = 5000ll;
+static const int64_t kMaxTargetDelayUs = 200000ll;
+static const int64_t kDefaultTargetDelayUs = 50000ll;
+
+// Round trip time assumed for retransmission requests until one has been
+// measured, and a lower bound on the measurements, which may be distorted
+// by packets that were merely reordered rather than lost.
+static const int64_t kDefaultRTTUs = 5000ll;
+static const int64_t kMinRTTUs = 1000ll;
+
+// Number of times retransmission of a single packet is requested.
+static const int32_t kMaxNacksPerPacket = 3;
+
+JitterBuffer::JitterBuffer()
+    : mNumPacketsQueued(0),
+      mHeadExtSeqNo(-1),
+      mTailExtSeqNo(-1),
+      mTotalBytesQueued(0ll),
+      mRTTUs(kDefaultRTTUs),
+      mNextNackUs(-1ll),
+      mNumNacksSent(0ll),
+      mNumNacksRecovered(0ll),
+      mLastRTPTime(0),
+      mLastArrivalTimeUs(-1ll),
+      mJitterUs(0ll),
+      mTargetDelayUs(kDefaultTargetDelayUs),
+      mLastDequeuedExtSeqNo(-1),
+      mFirstFailedAttemptUs(-1ll),
+      mNumPacketsDropped(0ll),
+      mNumPacketsLate(0ll),
+      mNumPacketsDuplicate(0ll) {
+    mPackets.insertAt(sp<ABuffer>(), 0, kPacketWindow);
+
+    NackState state;
+    state.mExtSeqNo = -1;
+    state.mNumSent = 0;
+    state.mDetectedUs = -1ll;
+    state.mLastSentUs = -1ll;
+    mNackStates.insertAt(state, 0, kPacketWindow);
+}
+
+JitterBuffer::~JitterBuffer() {
+}
+
+bool JitterBuffer::queueBuffer(
+        const sp<ABuffer> &buffer, int64_t nowUs, Vector<int32_t> *nacks) {
+    int32_t extSeqNo = buffer->int32Data();
+    int32_t prevTailExtSeqNo = mTailExtSeqNo;
+
+    if (mHeadExtSeqNo < 0) {
+        mHeadExtSeqNo = extSeqNo;
+        mTailExtSeqNo = extSeqNo;
+    } else if (extSeqNo < mHeadExtSeqNo) {
+        if (mLastDequeuedExtSeqNo >= 0
+                || mTailExtSeqNo - extSeqNo >= kPacketWindow) {
+            // This is a retransmission of a packet we've already returned
+            // or given up on.
+            ++mNumPacketsLate;
+            return false;
+        }
+
+        // Nothing has been dequeued yet, packets arrived out of order.
+        mHeadExtSeqNo = extSeqNo;
+    } else if (extSeqNo - mHeadExtSeqNo >= kPacketWindow) {
+        int32_t headExtSeqNo = extSeqNo - kPacketWindow + 1;
+
+        if (headExtSeqNo > mTailExtSeqNo) {
+            // None of the packets held survive, e.g. after an outage.
+            // Start over at this one rather than asking for a whole window
+            // of packets that were never seen.
+            ALOGI("packet window overflow, resynchronizing at extSeqNo %d",
+                  extSeqNo);
+
+            advanceHead(extSeqNo);
+            prevTailExtSeqNo = mTailExtSeqNo;
+        } else {
+            ALOGI("packet window overflow, skipping ahead to extSeqNo %d",
+                  headExtSeqNo);
+
+            advanceHead(headExtSeqNo);
+        }
+    }
+
+    sp<ABuffer> &slot = mPackets.editItemAt(extSeqNo & (kPacketWindow - 1));
+
+    if (slot != NULL) {
+        ++mNumPacketsDuplicate;
+        return false;
+    }
+
+    slot = buffer;
+    ++mNumPacketsQueued;
+    mTotalBytesQueued += buffer->size();
+
+    if (extSeqNo > mTailExtSeqNo) {
+        mTailExtSeqNo = extSeqNo;
+    }
+
+    if (!updateRTT(extSeqNo, nowUs)) {
+        // Retransmissions would distort the jitter estimate.
+        updateJitter(buffer, nowUs);
+    }
+
+    if (prevTailExtSeqNo >= 0 && extSeqNo > prevTailExtSeqNo + 1) {
+        // This packet opened a gap, ask for the missing ones right away.
+        // Packets found missing earlier are retried from dequeueBuffer().
+        int32_t startExtSeqNo = prevTailExtSeqNo + 1;
+        if (startExtSeqNo < mHeadExtSeqNo) {
+            startExtSeqNo = mHeadExtSeqNo;
+        }
+
+        requestRetransmissions(startExtSeqNo, extSeqNo, nowUs, nacks);
+    }
+
+    return true;
+}
+
+bool JitterBuffer::updateRTT(int32_t extSeqNo, int64_t nowUs) {
+    const NackState &state =
+        mNackStates.itemAt(extSeqNo & (kPacketWindow - 1));
+
+    if (state.mExtSeqNo != extSeqNo || state.mNumSent == 0) {
+        return false;
+    }
+
+    ALOGI("Recovered after requesting retransmission of %d", extSeqNo);
+
+    ++mNumNacksRecovered;
+
+    if (state.mNumSent > 1) {
+        // Can't tell which request this answers.
+        return true;
+    }
+
+    int64_t rttUs = nowUs - state.mLastSentUs;
+    if (rttUs < kMinRTTUs) {
+        rttUs = kMinRTTUs;
+    }
+
+    mRTTUs += (rttUs - mRTTUs) / 8;
+
+    return true;
+}
+
+void JitterBuffer::requestRetransmissions(
+        int32_t startExtSeqNo, int32_t endExtSeqNo,
+        int64_t nowUs, Vector<int32_t> *nacks) {
+    for (int32_t extSeqNo = startExtSeqNo;
+            extSeqNo < endExtSeqNo; ++extSeqNo) {
+        size_t index = extSeqNo & (kPacketWindow - 1);
+
+        if (mPackets.itemAt(index) != NULL) {
+            continue;
+        }
+
+        NackState &state = mNackStates.editItemAt(index);
+
+        if (state.mExtSeqNo != extSeqNo) {
+            state.mExtSeqNo = extSeqNo;
+            state.mNumSent = 0;
+            state.mDetectedUs = nowUs;
+            state.mLastSentUs = -1ll;
+        }
+
+        int64_t retryIntervalUs = retransmissionTimeoutUs();
+
+        if (state.mNumSent >= kMaxNacksPerPacket
+                || nowUs + retryIntervalUs
+                        > state.mDetectedUs + kMaxTargetDelayUs) {
+            // Either we've asked often enough or a retransmission would
+            // arrive after we've given up on the packet, see
+            // holdDeadlineUs().
+            continue;
+        }
+
+        if (state.mNumSent > 0
+                && nowUs < state.mLastSentUs + retryIntervalUs) {
+            int64_t retryUs = state.mLastSentUs + retryIntervalUs;
+            if (mNextNackUs < 0ll || retryUs < mNextNackUs) {
+                mNextNackUs = retryUs;
+            }
+            continue;
+        }
+
+        ++state.mNumSent;
+        state.mLastSentUs = nowUs;
+        ++mNumNacksSent;
+
+        if (state.mNumSent < kMaxNacksPerPacket
+                && (mNextNackUs < 0ll
+                    || nowUs + retryIntervalUs < mNextNackUs)) {
+            mNextNackUs = nowUs + retryIntervalUs;
+        }
+
+        ALOGI("requesting retransmission of seqNo %d", extSeqNo & 0xffff);
+
+        nacks->push(extSeqNo & 0xffff);
+    }
+}
+
+// static
+void JitterBuffer::GetGenericNACKs(
+        const Vector<int32_t> &nacks, Vector<uint32_t> *entries) {
+    entries->clear();
+
+    uint16_t pid = 0;
+    uint16_t blp = 0;
+
+    for (size_t i = 0; i < nacks.size(); ++i) {
+        uint16_t seqNo = nacks.itemAt(i) & 0xffff;
+        uint16_t offset = seqNo - pid;
+
+        if (i > 0 && offset >= 1 && offset <= 16) {
+            blp |= 1 << (offset - 1);
+            continue;
+        }
+
+        if (i > 0) {
+            entries->push(((uint32_t)pid << 16) | blp);
+        }
+
+        pid = seqNo;
+        blp = 0;
+    }
+
+    if (!nacks.isEmpty()) {
+        entries->push(((uint32_t)pid << 16) | blp);
+    }
+}
+
+int64_t JitterBuffer::retransmissionTimeoutUs() const {
+    return mRTTUs + kJitterMultiplier * mJitterUs;
+}
+
+int64_t JitterBuffer::holdDeadlineUs() const {
+    int64_t deadlineUs = mFirstFailedAttemptUs + mTargetDelayUs;
+
+    const NackState &state =
+        mNackStates.itemAt(mHeadExtSeqNo & (kPacketWindow - 1));
+
+    if (state.mExtSeqNo == mHeadExtSeqNo && state.mNumSent > 0) {
+        // A retransmission has been requested, give it a chance to arrive
+        // even if that takes longer than the jitter alone would warrant.
+        int64_t retransmitUs = state.mLastSentUs + retransmissionTimeoutUs();
+
+        if (retransmitUs > state.mDetectedUs + kMaxTargetDelayUs) {
+            retransmitUs = state.mDetectedUs + kMaxTargetDelayUs;
+        }
+
+        if (retransmitUs > deadlineUs) {
+            deadlineUs = retransmitUs;
+        }
+    }
+
+    return deadlineUs;
+}
+
+void JitterBuffer::updateJitter(const sp<ABuffer> &buffer, int64_t nowUs) {
+    int32_t rtpTime;
+    if (!buffer->meta()->findInt32("rtp-time", &rtpTime)) {
+        return;
+    }
+
+    int64_t arrivalTimeUs;
+    if (!buffer->meta()->findInt64("arrivalTimeUs", &arrivalTimeUs)) {
+        arrivalTimeUs = nowUs;
+    }
+
+    if (mLastArrivalTimeUs >= 0ll) {
+        // D(i,j) = (Rj - Ri) - (Sj - Si), the difference in transit time
+        // of two consecutively received packets, and J += (|D| - J) / 16.
+        int32_t rtpDiff = (int32_t)((uint32_t)rtpTime - mLastRTPTime);
+
+        int64_t diffUs =
+            (arrivalTimeUs - mLastArrivalTimeUs)
+                - (rtpDiff * 1000000ll) / kRTPClockRateHz;
+
+        if (diffUs < 0ll) {
+            diffUs = -diffUs;
+        }
+
+        mJitterUs += (diffUs - mJitterUs) / 16;
+
+        int64_t targetDelayUs = kJitterMultiplier * mJitterUs;
+        if (targetDelayUs < kMinTargetDelayUs) {
+            targetDelayUs = kMinTargetDelayUs;
+        } else if (targetDelayUs > kMaxTargetDelayUs) {
+            targetDelayUs = kMaxTargetDelayUs;
+        }
+
+        mTargetDelayUs = targetDelayUs;
+    }
+
+    mLastRTPTime = (uint32_t)rtpTime;
+    mLastArrivalTimeUs = arrivalTimeUs;
+}
+
+void JitterBuffer::getStats(const sp<AMessage> &msg) const {
+    msg->setInt64("jitterUs", mJitterUs);
+    msg->setInt64("targetDelayUs", mTargetDelayUs);
+    msg->setInt64("rttUs", mRTTUs);
+    msg->setInt64("nacksSent", mNumNacksSent);
+    msg->setInt64("nacksRecovered", mNumNacksRecovered);
+    msg->setInt64("packetsDropped", mNumPacketsDropped);
+    msg->setInt64("packetsLate", mNumPacketsLate);
+    msg->setInt64("packetsDuplicate", mNumPacketsDuplicate);
+}
+
+sp<ABuffer> JitterBuffer::takePacket(int32_t extSeqNo) {
+    sp<ABuffer> &slot = mPackets.editItemAt(extSeqNo & (kPacketWindow - 1));
+
+    sp<ABuffer> buffer = slot;
+    if (buffer != NULL) {
+        slot.clear();
+        --mNumPacketsQueued;
+        mTotalBytesQueued -= buffer->size();
+    }
+
+    return buffer;
+}
+
+void JitterBuffer::advanceHead(int32_t extSeqNo) {
+    int32_t endExtSeqNo =
+        (extSeqNo <= mTailExtSeqNo) ? extSeqNo : mTailExtSeqNo + 1;
+
+    if (endExtSeqNo > mHeadExtSeqNo) {
+        mNumPacketsDropped += endExtSeqNo - mHeadExtSeqNo;
+    }
+
+    while (mHeadExtSeqNo < extSeqNo && mNumPacketsQueued > 0) {
+        takePacket(mHeadExtSeqNo++);
+    }
+
+    mHeadExtSeqNo = extSeqNo;
+
+    if (mTailExtSeqNo < mHeadExtSeqNo - 1) {
+        mTailExtSeqNo = mHeadExtSeqNo - 1;
+    }
+}
+
+sp<ABuffer> JitterBuffer::dequeueBuffer(
+        int64_t nowUs, Vector<int32_t> *nacks) {
+    if (mNumPacketsQueued == 0) {
+        if (mFirstFailedAttemptUs < 0ll) {
+            mFirstFailedAttemptUs = nowUs;
+        } else {
+            ALOGV("no packets available for %.2f secs",
+                    (nowUs - mFirstFailedAttemptUs) / 1E6);
+        }
+
+        return NULL;
+    }
+
+    sp<ABuffer> buffer = takePacket(mHeadExtSeqNo);
+
+    if (buffer != NULL) {
+        mLastDequeuedExtSeqNo = mHeadExtSeqNo++;
+        mFirstFailedAttemptUs = -1ll;
+
+        return buffer;
+    }
+
+    if (mFirstFailedAttemptUs < 0ll) {
+        mFirstFailedAttemptUs = nowUs;
+
+        ALOGI("failed to get the correct packet the first time.");
+        return NULL;
+    }
+
+    if (mNextNackUs >= 0ll && nowUs >= mNextNackUs) {
+        // mTailExtSeqNo itself was received, everything missing is before
+        // it. The sweep finds the next retry due, if any.
+        mNextNackUs = -1ll;
+        requestRetransmissions(mHeadExtSeqNo, mTailExtSeqNo, nowUs, nacks);
+    }
+
+    int64_t deadlineUs = holdDeadlineUs();
+
+    if (deadlineUs > nowUs) {
+        // We're willing to wait a little while to get the right packet,
+        // longer the more the network delay varies or while we're waiting
+        // for a retransmission.
+        ALOGV("still waiting for the correct packet to arrive.");
+
+        return NULL;
+    }
+
+    ALOGI("dropping packet. extSeqNo %d didn't arrive within %lld us "
+          "(jitter %lld us, rtt %lld us)",
+          mHeadExtSeqNo, deadlineUs - mFirstFailedAttemptUs,
+          mJitterUs, mRTTUs);
+
+    // Permanent failure, we never received the packet. Skip ahead to the
+    // next one we did receive, it is at most kPacketWindow slots away.
+    while ((buffer = takePacket(mHeadExtSeqNo)) == NULL) {
+        ++mHeadExtSeqNo;
+        ++mNumPacketsDropped;
+    }
+
+    mLastDequeuedExtSeqNo = mHeadExtSeqNo++;
+    mFirstFailedAttemptUs = -1ll;
+
+    return buffer;
+}
+
+}  // namespace android
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef JITTER_BUFFER_H_
+
+#define JITTER_BUFFER_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+#include <utils/Vector.h>
+
+namespace android {
+
+struct ABuffer;
+struct AMessage;
+
+// Puts RTP packets, tagged with their extended sequence number as
+// int32Data(), back into order. A missing packet is waited for as long as
+// the interarrival jitter suggests it may still arrive, and longer if its
+// retransmission has been requested.
+// All times are passed in by the caller, in the ALooper::GetNowUs() time
+// base. The 16 bit sequence numbers of packets whose retransmission should
+// be requested are appended to "nacks". Not thread-safe.
+struct JitterBuffer {
+    enum {
+        // Number of packets, starting at the next one to be dequeued, that
+        // can be held for reordering. Has to be a power of two.
+        kPacketWindow = 1024,
+    };
+
+    JitterBuffer();
+    ~JitterBuffer();
+
+    // Returns false if the packet was dropped, being a duplicate or older
+    // than anything still held.
+    bool queueBuffer(
+            const sp<ABuffer> &buffer, int64_t nowUs, Vector<int32_t> *nacks);
+
+    // Returns the next packet in order, or NULL if it is still waited for.
+    sp<ABuffer> dequeueBuffer(int64_t nowUs, Vector<int32_t> *nacks);
+
+    int64_t totalBytesQueued() const { return mTotalBytesQueued; }
+
+    // Fills in "jitterUs", the RFC 3550 interarrival jitter estimate,
+    // "targetDelayUs", how long a missing packet is currently waited for,
+    // "rttUs", the round trip time of retransmission requests,
+    // "nacksSent", the number of retransmissions requested,
+    // "nacksRecovered", how many of those arrived, "packetsDropped", the
+    // packets given up on, and "packetsLate" and "packetsDuplicate", those
+    // that arrived too late or more than once.
+    void getStats(const sp<AMessage> &msg) const;
+
+    // Packs the 16 bit sequence numbers "nacks", in the ascending order
+    // queueBuffer() and dequeueBuffer() produce them, into Generic NACK
+    // FCI entries (RFC 4585, section 6.2.1), the PID in the upper and the
+    // bitmask of following lost packets (BLP) in the lower 16 bits.
+    static void GetGenericNACKs(
+            const Vector<int32_t> &nacks, Vector<uint32_t> *entries);
+
+private:
+    // Retransmission requests for the missing packet "mExtSeqNo", the state
+    // is stale if the slot has since been reused for another packet.
+    struct NackState {
+        int32_t mExtSeqNo;
+        int32_t mNumSent;
+        int64_t mDetectedUs;
+        int64_t mLastSentUs;
+    };
+
+    // Ring of kPacketWindow slots, the packet with extended sequence number
+    // n is found at index n & (kPacketWindow - 1). Slots from mHeadExtSeqNo
+    // up to mTailExtSeqNo are occupied or missing packets.
+    Vector<sp<ABuffer> > mPackets;
+    size_t mNumPacketsQueued;
+    int32_t mHeadExtSeqNo;
+    int32_t mTailExtSeqNo;
+    int64_t mTotalBytesQueued;
+
+    // Parallel to mPackets.
+    Vector<NackState> mNackStates;
+    int64_t mRTTUs;
+    int64_t mNextNackUs;
+    int64_t mNumNacksSent;
+    int64_t mNumNacksRecovered;
+
+    // Interarrival jitter estimate, see RFC 3550, section 6.4.1, and the
+    // hold time for missing packets derived from it.
+    uint32_t mLastRTPTime;
+    int64_t mLastArrivalTimeUs;
+    int64_t mJitterUs;
+    int64_t mTargetDelayUs;
+
+    int32_t mLastDequeuedExtSeqNo;
+    int64_t mFirstFailedAttemptUs;
+
+    int64_t mNumPacketsDropped;
+    int64_t mNumPacketsLate;
+    int64_t mNumPacketsDuplicate;
+
+    sp<ABuffer> takePacket(int32_t extSeqNo);
+
+    void updateJitter(const sp<ABuffer> &buffer, int64_t nowUs);
+
+    // Returns true if the packet "extSeqNo" that just arrived had been
+    // requested for retransmission.
+    bool updateRTT(int32_t extSeqNo, int64_t nowUs);
+
+    // Requests retransmission of the missing packets in
+    // [startExtSeqNo, endExtSeqNo) that are due for a (another) request and
+    // can still arrive before they're given up on. Pulls mNextNackUs in to
+    // the earliest retry still to come in that range.
+    void requestRetransmissions(
+            int32_t startExtSeqNo, int32_t endExtSeqNo,
+            int64_t nowUs, Vector<int32_t> *nacks);
+
+    // How long a requested retransmission is expected to take at most.
+    int64_t retransmissionTimeoutUs() const;
+
+    // Time at which the missing packet mHeadExtSeqNo is given up on.
+    int64_t holdDeadlineUs() const;
+
+    // Gives up on all packets before "extSeqNo".
+    void advanceHead(int32_t extSeqNo);
+
+    DISALLOW_EVIL_CONSTRUCTORS(JitterBuffer);
+};
+
+}  // namespace android
+
+#endif  // JITTER_BUFFER_H_
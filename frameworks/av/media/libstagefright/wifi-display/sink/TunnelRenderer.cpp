@@ -37,6 +37,10 @@
 
 namespace android {
 
+// A partially filled player buffer is handed over at the latest this long
+// after the first payload was copied into it.
+static const int64_t kMaxCoalesceDelayUs = 5000ll;
+
 struct TunnelRenderer::PlayerClient : public BnMediaPlayerClient {
     PlayerClient() {}
 
@@ -63,6 +67,10 @@ struct TunnelRenderer::StreamSource : public BnStreamSource {
 
     void doSomeWork();
 
+    // Hands over the partially filled buffer if it is still the one
+    // started in "generation".
+    void flush(int32_t generation);
+
 protected:
     virtual ~StreamSource();
 
@@ -78,6 +86,16 @@ private:
 
     size_t mNumDeqeued;
 
+    // Consecutive payloads are copied into the buffer mFillIndex until the
+    // next one no longer fits, mPendingBuffer is a payload that has been
+    // dequeued but not copied yet.
+    ssize_t mFillIndex;
+    size_t mFillSize;
+    int32_t mFillGeneration;
+    sp<ABuffer> mPendingBuffer;
+
+    void queueFilledBuffer();
+
     DISALLOW_EVIL_CONSTRUCTORS(StreamSource);
 };
 
@@ -85,7 +103,10 @@ private:
 
 TunnelRenderer::StreamSource::StreamSource(TunnelRenderer *owner)
     : mOwner(owner),
-      mNumDeqeued(0) {
+      mNumDeqeued(0),
+      mFillIndex(-1),
+      mFillSize(0),
+      mFillGeneration(0) {
 }
 
 TunnelRenderer::StreamSource::~StreamSource() {
@@ -119,43 +140,107 @@ uint32_t TunnelRenderer::StreamSource::flags() const {
 void TunnelRenderer::StreamSource::doSomeWork() {
     Mutex::Autolock autoLock(mLock);
 
-    while (!mIndicesAvailable.empty()) {
-        sp<ABuffer> srcBuffer = mOwner->dequeueBuffer();
-        if (srcBuffer == NULL) {
-            break;
+    for (;;) {
+        if (mPendingBuffer == NULL) {
+            mPendingBuffer = mOwner->dequeueBuffer();
+            if (mPendingBuffer == NULL) {
+                break;
+            }
+
+            ++mNumDeqeued;
+
+            if (mNumDeqeued == 1) {
+                ALOGI("fixing real time now.");
+
+                sp<AMessage> extra = new AMessage;
+
+                extra->setInt32(
+                        IStreamListener::kKeyDiscontinuityMask,
+                        ATSParser::DISCONTINUITY_ABSOLUTE_TIME);
+
+                extra->setInt64("timeUs", ALooper::GetNowUs());
+
+                mListener->issueCommand(
+                        IStreamListener::DISCONTINUITY,
+                        false /* synchronous */,
+                        extra);
+            }
+
+            ALOGV("dequeue TS packet of size %d", mPendingBuffer->size());
         }
 
-        ++mNumDeqeued;
+        if (mFillIndex < 0) {
+            if (mIndicesAvailable.empty()) {
+                break;
+            }
 
-        if (mNumDeqeued == 1) {
-            ALOGI("fixing real time now.");
+            mFillIndex = *mIndicesAvailable.begin();
+            mIndicesAvailable.erase(mIndicesAvailable.begin());
 
-            sp<AMessage> extra = new AMessage;
+            mFillSize = 0;
+        }
 
-            extra->setInt32(
-                    IStreamListener::kKeyDiscontinuityMask,
-                    ATSParser::DISCONTINUITY_ABSOLUTE_TIME);
+        sp<IMemory> mem = mBuffers.itemAt(mFillIndex);
+        size_t size = mPendingBuffer->size();
 
-            extra->setInt64("timeUs", ALooper::GetNowUs());
+        CHECK_LE(size, mem->size());
+        CHECK_EQ((size % 188), 0u);
 
-            mListener->issueCommand(
-                    IStreamListener::DISCONTINUITY,
-                    false /* synchronous */,
-                    extra);
+        if (mFillSize + size > mem->size()) {
+            queueFilledBuffer();
+            continue;
         }
 
-        ALOGV("dequeue TS packet of size %d", srcBuffer->size());
+        if (mFillSize == 0) {
+            sp<AMessage> msg =
+                new AMessage(kWhatFlushStreamSource, mOwner->id());
+            msg->setInt32("generation", ++mFillGeneration);
+            msg->post(kMaxCoalesceDelayUs);
+        }
+
+        // The one copy between the socket and the player, counted below.
+        // Payloads aren't received in place: the player allocates these
+        // buffers, RTPSink reads the datagrams and a payload's position
+        // here is only known after reordering.
+        memcpy((uint8_t *)mem->pointer() + mFillSize,
+               mPendingBuffer->data(),
+               size);
+
+        mOwner->onBytesCopied(size);
 
-        size_t index = *mIndicesAvailable.begin();
-        mIndicesAvailable.erase(mIndicesAvailable.begin());
+        mFillSize += size;
+        mPendingBuffer.clear();
 
-        sp<IMemory> mem = mBuffers.itemAt(index);
-        CHECK_LE(srcBuffer->size(), mem->size());
-        CHECK_EQ((srcBuffer->size() % 188), 0u);
+        if (mFillSize + size > mem->size()) {
+            // Another payload like this one wouldn't fit anymore.
+            queueFilledBuffer();
+        }
+    }
+}
+
+void TunnelRenderer::StreamSource::flush(int32_t generation) {
+    {
+        Mutex::Autolock autoLock(mLock);
 
-        memcpy(mem->pointer(), srcBuffer->data(), srcBuffer->size());
-        mListener->queueBuffer(index, srcBuffer->size());
+        if (mFillIndex < 0
+                || mFillSize == 0
+                || generation != mFillGeneration) {
+            return;
+        }
+
+        queueFilledBuffer();
     }
+
+    doSomeWork();
+}
+
+void TunnelRenderer::StreamSource::queueFilledBuffer() {
+    ALOGV("queueing %d bytes of transport stream", mFillSize);
+
+    mListener->queueBuffer(mFillIndex, mFillSize);
+
+    mFillIndex = -1;
+    mFillSize = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -165,10 +250,10 @@ TunnelRenderer::TunnelRenderer(
         const sp<ISurfaceTexture> &surfaceTex)
     : mNotifyLost(notifyLost),
       mSurfaceTex(surfaceTex),
-      mTotalBytesQueued(0ll),
-      mLastDequeuedExtSeqNo(-1),
-      mFirstFailedAttemptUs(-1ll),
-      mRequestedRetransmission(false) {
+      mNumBytesCopied(0ll),
+      mCopyPeriodStartUs(-1ll),
+      mCopyPeriodStartBytes(0ll),
+      mBytesCopiedPerSec(0ll) {
 }
 
 TunnelRenderer::~TunnelRenderer() {
@@ -178,129 +263,68 @@ TunnelRenderer::~TunnelRenderer() {
 void TunnelRenderer::queueBuffer(const sp<ABuffer> &buffer) {
     Mutex::Autolock autoLock(mLock);
 
-    mTotalBytesQueued += buffer->size();
-
-    if (mPackets.empty()) {
-        mPackets.push_back(buffer);
-        return;
-    }
-
-    int32_t newExtendedSeqNo = buffer->int32Data();
-
-    List<sp<ABuffer> >::iterator firstIt = mPackets.begin();
-    List<sp<ABuffer> >::iterator it = --mPackets.end();
-    for (;;) {
-        int32_t extendedSeqNo = (*it)->int32Data();
+    Vector<int32_t> nacks;
+    mJitterBuffer.queueBuffer(buffer, ALooper::GetNowUs(), &nacks);
 
-        if (extendedSeqNo == newExtendedSeqNo) {
-            // Duplicate packet.
-            return;
-        }
+    notifyLost(nacks);
+}
 
-        if (extendedSeqNo < newExtendedSeqNo) {
-            // Insert new packet after the one at "it".
-            mPackets.insert(++it, buffer);
-            return;
-        }
+void TunnelRenderer::notifyLost(const Vector<int32_t> &nacks) {
+    Vector<uint32_t> entries;
+    JitterBuffer::GetGenericNACKs(nacks, &entries);
 
-        if (it == firstIt) {
-            // Insert new packet before the first existing one.
-            mPackets.insert(it, buffer);
-            return;
-        }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        uint32_t entry = entries.itemAt(i);
 
-        --it;
+        sp<AMessage> notify = mNotifyLost->dup();
+        notify->setInt32("seqNo", entry >> 16);
+        notify->setInt32("blp", entry & 0xffff);
+        notify->post();
     }
 }
 
-sp<ABuffer> TunnelRenderer::dequeueBuffer() {
+void TunnelRenderer::getStats(const sp<AMessage> &msg) const {
     Mutex::Autolock autoLock(mLock);
 
-    sp<ABuffer> buffer;
-    int32_t extSeqNo;
-    while (!mPackets.empty()) {
-        buffer = *mPackets.begin();
-        extSeqNo = buffer->int32Data();
-
-        if (mLastDequeuedExtSeqNo < 0 || extSeqNo > mLastDequeuedExtSeqNo) {
-            break;
-        }
-
-        // This is a retransmission of a packet we've already returned.
-
-        mTotalBytesQueued -= buffer->size();
-        buffer.clear();
-        extSeqNo = -1;
-
-        mPackets.erase(mPackets.begin());
-    }
-
-    if (mPackets.empty()) {
-        if (mFirstFailedAttemptUs < 0ll) {
-            mFirstFailedAttemptUs = ALooper::GetNowUs();
-            mRequestedRetransmission = false;
-        } else {
-            ALOGV("no packets available for %.2f secs",
-                    (ALooper::GetNowUs() - mFirstFailedAttemptUs) / 1E6);
-        }
-
-        return NULL;
-    }
-
-    if (mLastDequeuedExtSeqNo < 0 || extSeqNo == mLastDequeuedExtSeqNo + 1) {
-        if (mRequestedRetransmission) {
-            ALOGI("Recovered after requesting retransmission of %d",
-                  extSeqNo);
-        }
-
-        mLastDequeuedExtSeqNo = extSeqNo;
-        mFirstFailedAttemptUs = -1ll;
-        mRequestedRetransmission = false;
-
-        mPackets.erase(mPackets.begin());
+    mJitterBuffer.getStats(msg);
 
-        mTotalBytesQueued -= buffer->size();
+    msg->setInt64("bytesCopied", mNumBytesCopied);
+    msg->setInt64("bytesCopiedPerSec", mBytesCopiedPerSec);
+}
 
-        return buffer;
-    }
+void TunnelRenderer::onBytesCopied(size_t size) {
+    Mutex::Autolock autoLock(mLock);
 
-    if (mFirstFailedAttemptUs < 0ll) {
-        mFirstFailedAttemptUs = ALooper::GetNowUs();
+    int64_t nowUs = ALooper::GetNowUs();
 
-        ALOGI("failed to get the correct packet the first time.");
-        return NULL;
+    if (mCopyPeriodStartUs < 0ll) {
+        mCopyPeriodStartUs = nowUs;
+        mCopyPeriodStartBytes = mNumBytesCopied;
     }
 
-    if (mFirstFailedAttemptUs + 50000ll > ALooper::GetNowUs()) {
-        // We're willing to wait a little while to get the right packet.
-
-        if (!mRequestedRetransmission) {
-            ALOGI("requesting retransmission of seqNo %d",
-                  (mLastDequeuedExtSeqNo + 1) & 0xffff);
+    mNumBytesCopied += size;
 
-            sp<AMessage> notify = mNotifyLost->dup();
-            notify->setInt32("seqNo", (mLastDequeuedExtSeqNo + 1) & 0xffff);
-            notify->post();
+    if (nowUs - mCopyPeriodStartUs >= 1000000ll) {
+        mBytesCopiedPerSec =
+            (mNumBytesCopied - mCopyPeriodStartBytes) * 1000000ll
+                / (nowUs - mCopyPeriodStartUs);
 
-            mRequestedRetransmission = true;
-        } else {
-            ALOGI("still waiting for the correct packet to arrive.");
-        }
+        ALOGV("copying %lld bytes/sec into the player's buffers",
+              mBytesCopiedPerSec);
 
-        return NULL;
+        mCopyPeriodStartUs = nowUs;
+        mCopyPeriodStartBytes = mNumBytesCopied;
     }
+}
 
-    ALOGI("dropping packet. extSeqNo %d didn't arrive in time",
-            mLastDequeuedExtSeqNo + 1);
-
-    // Permanent failure, we never received the packet.
-    mLastDequeuedExtSeqNo = extSeqNo;
-    mFirstFailedAttemptUs = -1ll;
-    mRequestedRetransmission = false;
+sp<ABuffer> TunnelRenderer::dequeueBuffer() {
+    Mutex::Autolock autoLock(mLock);
 
-    mTotalBytesQueued -= buffer->size();
+    Vector<int32_t> nacks;
+    sp<ABuffer> buffer =
+        mJitterBuffer.dequeueBuffer(ALooper::GetNowUs(), &nacks);
 
-    mPackets.erase(mPackets.begin());
+    notifyLost(nacks);
 
     return buffer;
 }
@@ -315,10 +339,16 @@ void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
             queueBuffer(buffer);
 
             if (mStreamSource == NULL) {
-                if (mTotalBytesQueued > 0ll) {
+                int64_t totalBytesQueued;
+                {
+                    Mutex::Autolock autoLock(mLock);
+                    totalBytesQueued = mJitterBuffer.totalBytesQueued();
+                }
+
+                if (totalBytesQueued > 0ll) {
                     initPlayer();
                 } else {
-                    ALOGI("Have %lld bytes queued...", mTotalBytesQueued);
+                    ALOGI("Have %lld bytes queued...", totalBytesQueued);
                 }
             } else {
                 mStreamSource->doSomeWork();
@@ -326,6 +356,17 @@ void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatFlushStreamSource:
+        {
+            int32_t generation;
+            CHECK(msg->findInt32("generation", &generation));
+
+            if (mStreamSource != NULL) {
+                mStreamSource->flush(generation);
+            }
+            break;
+        }
+
         default:
             TRESPASS();
     }
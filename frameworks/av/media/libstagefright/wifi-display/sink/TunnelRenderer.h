@@ -0,0 +1,103 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TUNNEL_RENDERER_H_
+
+#define TUNNEL_RENDERER_H_
+
+#include "JitterBuffer.h"
+
+#include <gui/Surface.h>
+#include <media/stagefright/foundation/AHandler.h>
+
+namespace android {
+
+struct ABuffer;
+struct SurfaceComposerClient;
+struct SurfaceControl;
+struct Surface;
+struct IMediaPlayer;
+struct IStreamListener;
+
+// This class reassembles incoming RTP packets into the correct order
+// and sends the resulting transport stream to a mediaplayer instance
+// for playback.
+struct TunnelRenderer : public AHandler {
+    // "notifyLost" is posted once per Generic NACK entry (RFC 4585) with
+    // the 16 bit sequence number of the first missing packet as "seqNo" and
+    // the bitmask of the missing packets among the 16 following it as
+    // "blp". A sink that only looks at "seqNo" still gets the first one.
+    TunnelRenderer(
+            const sp<AMessage> &notifyLost,
+            const sp<ISurfaceTexture> &surfaceTex);
+
+    sp<ABuffer> dequeueBuffer();
+
+    // Fills in the statistics of JitterBuffer::getStats() as well as
+    // "bytesCopied" and "bytesCopiedPerSec", the transport stream copied
+    // into the player's buffers in total and over the last second or so.
+    void getStats(const sp<AMessage> &msg) const;
+
+    enum {
+        kWhatQueueBuffer,
+        kWhatFlushStreamSource,
+    };
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+    virtual ~TunnelRenderer();
+
+private:
+    struct PlayerClient;
+    struct StreamSource;
+
+    mutable Mutex mLock;
+
+    sp<AMessage> mNotifyLost;
+    sp<ISurfaceTexture> mSurfaceTex;
+
+    // Protected by mLock, as dequeueBuffer() is called by the player.
+    JitterBuffer mJitterBuffer;
+
+    sp<SurfaceComposerClient> mComposerClient;
+    sp<SurfaceControl> mSurfaceControl;
+    sp<Surface> mSurface;
+    sp<PlayerClient> mPlayerClient;
+    sp<IMediaPlayer> mPlayer;
+    sp<StreamSource> mStreamSource;
+
+    int64_t mNumBytesCopied;
+    int64_t mCopyPeriodStartUs;
+    int64_t mCopyPeriodStartBytes;
+    int64_t mBytesCopiedPerSec;
+
+    void initPlayer();
+    void destroyPlayer();
+
+    void queueBuffer(const sp<ABuffer> &buffer);
+
+    // Posts mNotifyLost for each of the 16 bit sequence numbers.
+    void notifyLost(const Vector<int32_t> &nacks);
+
+    // Called by StreamSource for every payload copied into an IMemory.
+    void onBytesCopied(size_t size);
+
+    DISALLOW_EVIL_CONSTRUCTORS(TunnelRenderer);
+};
+
+}  // namespace android
+
+#endif  // TUNNEL_RENDERER_H_
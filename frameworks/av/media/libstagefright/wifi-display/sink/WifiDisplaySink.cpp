@@ -138,8 +138,13 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
 
             sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());
 
+            // Keep RTSP requests from being held back by Nagle.
+            ANetworkSession::SessionOptions options;
+            options.mNoDelay = true;
+
             status_t err = mNetSession->createRTSPClient(
-                    mRTSPHost.c_str(), sourcePort, notify, &mSessionID);
+                    mRTSPHost.c_str(), sourcePort, notify, &mSessionID,
+                    &options);
             CHECK_EQ(err, (status_t)OK);
 
             mState = CONNECTING;
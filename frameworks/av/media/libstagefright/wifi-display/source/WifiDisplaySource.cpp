@@ -146,8 +146,13 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
                 if (inet_aton(iface.c_str(), &mInterfaceAddr) != 0) {
                     sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());
 
+                    // Keep RTSP requests from being held back by Nagle.
+                    ANetworkSession::SessionOptions options;
+                    options.mNoDelay = true;
+
                     err = mNetSession->createRTSPServer(
-                            mInterfaceAddr, port, notify, &mSessionID);
+                            mInterfaceAddr, port, notify, &mSessionID,
+                            &options);
                 } else {
                     err = -EINVAL;
                 }
@@ -404,17 +409,7 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
                 int32_t sessionID;
                 CHECK(msg->findInt32("sessionID", &sessionID));
 
-                char header[4];
-                header[0] = '$';
-                header[1] = channel;
-                header[2] = data->size() >> 8;
-                header[3] = data->size() & 0xff;
-
-                mNetSession->sendRequest(
-                        sessionID, header, sizeof(header));
-
-                mNetSession->sendRequest(
-                        sessionID, data->data(), data->size());
+                mNetSession->sendInterleavedData(sessionID, channel, data);
             }
             break;
         }
@@ -0,0 +1,33 @@
+# Build the unit tests.
+LOCAL_PATH:= $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := JitterBuffer_test
+
+LOCAL_MODULE_TAGS := tests
+
+# JitterBuffer only needs ABuffer and AMessage, build it in rather than
+# pulling in all of libstagefright_wfd.
+LOCAL_SRC_FILES := \
+        JitterBuffer_test.cpp           \
+        ../sink/JitterBuffer.cpp        \
+
+LOCAL_SHARED_LIBRARIES := \
+        liblog                          \
+        libstagefright_foundation       \
+        libstlport                      \
+        libutils                        \
+
+LOCAL_STATIC_LIBRARIES := \
+        libgtest                        \
+        libgtest_main                   \
+
+LOCAL_C_INCLUDES := \
+        bionic                                          \
+        bionic/libstdc++/include                        \
+        external/gtest/include                          \
+        external/stlport/stlport                        \
+        $(TOP)/frameworks/av/media/libstagefright/wifi-display \
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,653 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "JitterBuffer_test"
+#include <utils/Log.h>
+
+#include "sink/JitterBuffer.h"
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+namespace android {
+
+// Packets are sent every kPacketIntervalUs, RTP timestamps advance in step.
+static const int64_t kPacketIntervalUs = 1000ll;
+static const int32_t kRTPTicksPerPacket = 90;
+
+// The player asks for data at this interval.
+static const int64_t kTickUs = 1000ll;
+
+// A recorded trace to replay in addition to the synthetic ones, see
+// LoadTrace().
+static const char *kTraceEnvVar = "JITTER_BUFFER_TRACE";
+
+// Arrival of packet "mExtSeqNo", with RTP timestamp "mRTPTime", at
+// "mTimeUs".
+struct TraceEvent {
+    int64_t mTimeUs;
+    int32_t mExtSeqNo;
+    uint32_t mRTPTime;
+};
+
+static int CompareTraceEvents(const TraceEvent *a, const TraceEvent *b) {
+    if (a->mTimeUs != b->mTimeUs) {
+        return a->mTimeUs < b->mTimeUs ? -1 : 1;
+    }
+
+    return a->mExtSeqNo - b->mExtSeqNo;
+}
+
+static TraceEvent MakeEvent(int64_t timeUs, int32_t extSeqNo) {
+    TraceEvent event;
+    event.mTimeUs = timeUs;
+    event.mExtSeqNo = extSeqNo;
+    event.mRTPTime = extSeqNo * kRTPTicksPerPacket;
+
+    return event;
+}
+
+static sp<ABuffer> MakePacket(
+        int32_t extSeqNo, int64_t arrivalTimeUs, uint32_t rtpTime) {
+    sp<ABuffer> buffer = new ABuffer(188);
+    buffer->setInt32Data(extSeqNo);
+    buffer->meta()->setInt32("rtp-time", rtpTime);
+    buffer->meta()->setInt64("arrivalTimeUs", arrivalTimeUs);
+
+    return buffer;
+}
+
+static sp<ABuffer> MakePacket(int32_t extSeqNo, int64_t arrivalTimeUs) {
+    return MakePacket(
+            extSeqNo, arrivalTimeUs, extSeqNo * kRTPTicksPerPacket);
+}
+
+// Returns the extended sequence number closest to "refExtSeqNo" whose lower
+// 16 bits are "seqNo".
+static int32_t ExtendSeqNo(int32_t seqNo, int32_t refExtSeqNo) {
+    int32_t extSeqNo = (refExtSeqNo & ~0xffff) | (seqNo & 0xffff);
+
+    if (extSeqNo > refExtSeqNo + 0x8000) {
+        extSeqNo -= 0x10000;
+    } else if (extSeqNo < refExtSeqNo - 0x8000) {
+        extSeqNo += 0x10000;
+    }
+
+    return extSeqNo;
+}
+
+static int64_t GetStat(const JitterBuffer &jitterBuffer, const char *name) {
+    sp<AMessage> stats = new AMessage;
+    jitterBuffer.getStats(stats);
+
+    int64_t value = -1ll;
+    EXPECT_TRUE(stats->findInt64(name, &value)) << name;
+
+    return value;
+}
+
+// Feeds a trace of arrivals into a JitterBuffer and drains it every kTickUs
+// the way the player does. Retransmission requests are answered after
+// mRetransmitDelayUs unless that is negative.
+struct TraceReplayer {
+    TraceReplayer()
+        : mRetransmitDelayUs(-1ll),
+          mMaxExtSeqNo(-1) {
+    }
+
+    JitterBuffer mJitterBuffer;
+
+    int64_t mRetransmitDelayUs;
+
+    // Outputs.
+    Vector<int32_t> mDequeued;
+    Vector<int64_t> mDequeuedUs;
+    Vector<TraceEvent> mNacks;
+
+    void replay(const Vector<TraceEvent> &trace, int64_t endUs) {
+        Vector<TraceEvent> sorted = trace;
+        sorted.sort(CompareTraceEvents);
+
+        size_t next = 0;
+        mRetransmissions.clear();
+
+        for (int64_t nowUs = 0ll; nowUs <= endUs; nowUs += kTickUs) {
+            while (next < sorted.size()
+                    && sorted.itemAt(next).mTimeUs <= nowUs) {
+                queue(sorted.itemAt(next++), nowUs);
+            }
+
+            for (size_t i = 0; i < mRetransmissions.size();) {
+                TraceEvent event = mRetransmissions.itemAt(i);
+
+                if (event.mTimeUs > nowUs) {
+                    ++i;
+                    continue;
+                }
+
+                mRetransmissions.removeAt(i);
+                queue(event, nowUs);
+            }
+
+            for (;;) {
+                Vector<int32_t> nacks;
+                sp<ABuffer> buffer =
+                    mJitterBuffer.dequeueBuffer(nowUs, &nacks);
+
+                onNacks(nacks, nowUs);
+
+                if (buffer == NULL) {
+                    break;
+                }
+
+                mDequeued.push(buffer->int32Data());
+                mDequeuedUs.push(nowUs);
+            }
+        }
+    }
+
+    // Returns the number of packets dequeued in the wrong order or more
+    // than once.
+    size_t countOutOfOrder() const {
+        size_t n = 0;
+        for (size_t i = 1; i < mDequeued.size(); ++i) {
+            if (mDequeued.itemAt(i) <= mDequeued.itemAt(i - 1)) {
+                ++n;
+            }
+        }
+
+        return n;
+    }
+
+    size_t countNacks(int32_t seqNo) const {
+        size_t n = 0;
+        for (size_t i = 0; i < mNacks.size(); ++i) {
+            if (mNacks.itemAt(i).mExtSeqNo == seqNo) {
+                ++n;
+            }
+        }
+
+        return n;
+    }
+
+    ssize_t indexOfDequeued(int32_t extSeqNo) const {
+        for (size_t i = 0; i < mDequeued.size(); ++i) {
+            if (mDequeued.itemAt(i) == extSeqNo) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+private:
+    int32_t mMaxExtSeqNo;
+    Vector<TraceEvent> mRetransmissions;
+
+    void queue(const TraceEvent &event, int64_t nowUs) {
+        if (event.mExtSeqNo > mMaxExtSeqNo) {
+            mMaxExtSeqNo = event.mExtSeqNo;
+        }
+
+        Vector<int32_t> nacks;
+        mJitterBuffer.queueBuffer(
+                MakePacket(event.mExtSeqNo, nowUs, event.mRTPTime),
+                nowUs, &nacks);
+
+        onNacks(nacks, nowUs);
+    }
+
+    void onNacks(const Vector<int32_t> &nacks, int64_t nowUs) {
+        for (size_t i = 0; i < nacks.size(); ++i) {
+            // Requests carry 16 bit sequence numbers, they're for packets
+            // sent before the latest one seen.
+            int32_t extSeqNo = ExtendSeqNo(nacks.itemAt(i), mMaxExtSeqNo);
+
+            mNacks.push(MakeEvent(nowUs, extSeqNo));
+
+            if (mRetransmitDelayUs >= 0ll) {
+                // Retransmissions don't enter the jitter estimate, their
+                // RTP timestamp doesn't matter.
+                mRetransmissions.push(
+                        MakeEvent(nowUs + mRetransmitDelayUs, extSeqNo));
+            }
+        }
+    }
+};
+
+// A steady stream of packets 0 .. numPackets - 1, less those in "lost".
+static void MakeTrace(
+        int32_t numPackets, const Vector<int32_t> &lost,
+        Vector<TraceEvent> *trace) {
+    trace->clear();
+
+    for (int32_t extSeqNo = 0; extSeqNo < numPackets; ++extSeqNo) {
+        bool isLost = false;
+        for (size_t i = 0; i < lost.size(); ++i) {
+            if (lost.itemAt(i) == extSeqNo) {
+                isLost = true;
+                break;
+            }
+        }
+
+        if (isLost) {
+            continue;
+        }
+
+        trace->push(MakeEvent(extSeqNo * kPacketIntervalUs, extSeqNo));
+    }
+}
+
+// Loads a trace recorded at a sink, one packet per line as
+// "<arrival time in seconds> <RTP sequence number> <RTP timestamp>", e.g.
+//
+//   tshark -r capture.pcap -d udp.port==15550,rtp -Y rtp -T fields \
+//          -e frame.time_relative -e rtp.seq -e rtp.timestamp > trace.txt
+//
+// Lines starting with '#' are ignored. Times are made relative to the first
+// packet, sequence numbers are extended across wraparound.
+static bool LoadTrace(const char *path, Vector<TraceEvent> *trace) {
+    trace->clear();
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    double startTimeS = 0.0;
+    int32_t maxExtSeqNo = -1;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        double timeS;
+        unsigned seqNo, rtpTime;
+
+        if (line[0] == '#'
+                || sscanf(line, "%lf %u %u", &timeS, &seqNo, &rtpTime) != 3) {
+            continue;
+        }
+
+        int32_t extSeqNo;
+        if (trace->isEmpty()) {
+            startTimeS = timeS;
+
+            // Leaves room for packets that were sent before the first one
+            // to arrive.
+            extSeqNo = 0x10000 | (seqNo & 0xffff);
+        } else {
+            extSeqNo = ExtendSeqNo(seqNo, maxExtSeqNo);
+        }
+
+        if (extSeqNo > maxExtSeqNo) {
+            maxExtSeqNo = extSeqNo;
+        }
+
+        TraceEvent event;
+        event.mTimeUs = (int64_t)((timeS - startTimeS) * 1E6);
+        event.mExtSeqNo = extSeqNo;
+        event.mRTPTime = rtpTime;
+        trace->push(event);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+static void ExpectInOrder(const Vector<int32_t> &dequeued, int32_t numPackets) {
+    ASSERT_EQ((size_t)numPackets, dequeued.size());
+
+    for (int32_t i = 0; i < numPackets; ++i) {
+        EXPECT_EQ(i, dequeued.itemAt(i));
+    }
+}
+
+TEST(JitterBufferTest, InOrderStreamPassesStraightThrough) {
+    Vector<TraceEvent> trace;
+    MakeTrace(100, Vector<int32_t>(), &trace);
+
+    TraceReplayer replayer;
+    replayer.replay(trace, 100 * kPacketIntervalUs);
+
+    ExpectInOrder(replayer.mDequeued, 100);
+
+    for (size_t i = 0; i < replayer.mDequeuedUs.size(); ++i) {
+        EXPECT_EQ((int64_t)i * kPacketIntervalUs,
+                  replayer.mDequeuedUs.itemAt(i));
+    }
+
+    EXPECT_EQ(0u, replayer.mNacks.size());
+    EXPECT_EQ(0ll, GetStat(replayer.mJitterBuffer, "jitterUs"));
+    EXPECT_EQ(0ll, GetStat(replayer.mJitterBuffer, "packetsDropped"));
+}
+
+TEST(JitterBufferTest, ReorderedPacketsAreDequeuedInOrder) {
+    Vector<TraceEvent> trace;
+    MakeTrace(20, Vector<int32_t>(), &trace);
+
+    // 5 arrives after 6.
+    trace.editItemAt(5).mTimeUs = trace.itemAt(6).mTimeUs + 1;
+
+    TraceReplayer replayer;
+    replayer.replay(trace, 20 * kPacketIntervalUs);
+
+    ExpectInOrder(replayer.mDequeued, 20);
+
+    // The gap in front of 6 was reported right away.
+    ASSERT_EQ(1u, replayer.mNacks.size());
+    EXPECT_EQ(5, replayer.mNacks.itemAt(0).mExtSeqNo);
+    EXPECT_EQ(6 * kPacketIntervalUs, replayer.mNacks.itemAt(0).mTimeUs);
+
+    // Counted as recovered, there's no telling a late packet apart from a
+    // retransmission.
+    EXPECT_EQ(1ll, GetStat(replayer.mJitterBuffer, "nacksRecovered"));
+    EXPECT_EQ(0ll, GetStat(replayer.mJitterBuffer, "packetsDropped"));
+}
+
+TEST(JitterBufferTest, ReorderingBeforeFirstDequeueMovesHeadBack) {
+    JitterBuffer jitterBuffer;
+    Vector<int32_t> nacks;
+
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(5, 0ll), 0ll, &nacks));
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(3, 0ll), 0ll, &nacks));
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(4, 0ll), 0ll, &nacks));
+
+    for (int32_t extSeqNo = 3; extSeqNo <= 5; ++extSeqNo) {
+        sp<ABuffer> buffer = jitterBuffer.dequeueBuffer(0ll, &nacks);
+        ASSERT_TRUE(buffer != NULL);
+        EXPECT_EQ(extSeqNo, buffer->int32Data());
+    }
+
+    EXPECT_TRUE(jitterBuffer.dequeueBuffer(0ll, &nacks) == NULL);
+}
+
+TEST(JitterBufferTest, DuplicatesAreDropped) {
+    JitterBuffer jitterBuffer;
+    Vector<int32_t> nacks;
+
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(0, 0ll), 0ll, &nacks));
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(1, 0ll), 0ll, &nacks));
+    EXPECT_FALSE(jitterBuffer.queueBuffer(MakePacket(1, 0ll), 0ll, &nacks));
+
+    EXPECT_EQ(1ll, GetStat(jitterBuffer, "packetsDuplicate"));
+    EXPECT_EQ(376ll, jitterBuffer.totalBytesQueued());
+}
+
+TEST(JitterBufferTest, PacketsAlreadyDequeuedAreRejected) {
+    JitterBuffer jitterBuffer;
+    Vector<int32_t> nacks;
+
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(0, 0ll), 0ll, &nacks));
+    EXPECT_TRUE(jitterBuffer.queueBuffer(MakePacket(1, 0ll), 0ll, &nacks));
+
+    EXPECT_TRUE(jitterBuffer.dequeueBuffer(0ll, &nacks) != NULL);
+    EXPECT_TRUE(jitterBuffer.dequeueBuffer(0ll, &nacks) != NULL);
+
+    EXPECT_FALSE(jitterBuffer.queueBuffer(MakePacket(0, 0ll), 0ll, &nacks));
+    EXPECT_EQ(1ll, GetStat(jitterBuffer, "packetsLate"));
+    EXPECT_EQ(0ll, jitterBuffer.totalBytesQueued());
+}
+
+TEST(JitterBufferTest, MissingPacketIsSkippedAfterHold) {
+    Vector<int32_t> lost;
+    lost.push(10);
+
+    Vector<TraceEvent> trace;
+    MakeTrace(40, lost, &trace);
+
+    TraceReplayer replayer;
+    replayer.replay(trace, 40 * kPacketIntervalUs);
+
+    ASSERT_EQ(39u, replayer.mDequeued.size());
+    EXPECT_EQ(-1, replayer.indexOfDequeued(10));
+    EXPECT_EQ(1ll, GetStat(replayer.mJitterBuffer, "packetsDropped"));
+
+    // Jitter is zero, so the hold is kMinTargetDelayUs (5 ms) after the
+    // first failed attempt at 11 ms, stretched while retransmission
+    // requests are outstanding. Those go out at 11, 16 and 21 ms, each
+    // waited for one (default) round trip time of 5 ms.
+    ASSERT_EQ(3u, replayer.countNacks(10));
+    EXPECT_EQ(11000ll, replayer.mNacks.itemAt(0).mTimeUs);
+    EXPECT_EQ(16000ll, replayer.mNacks.itemAt(1).mTimeUs);
+    EXPECT_EQ(21000ll, replayer.mNacks.itemAt(2).mTimeUs);
+
+    ssize_t index = replayer.indexOfDequeued(11);
+    ASSERT_GE(index, 0);
+    EXPECT_EQ(26000ll, replayer.mDequeuedUs.itemAt(index));
+
+    // Everything held back meanwhile comes out at once.
+    EXPECT_EQ(26000ll, replayer.mDequeuedUs.itemAt(index + 14));
+}
+
+TEST(JitterBufferTest, RetransmissionWithinHoldIsRecovered) {
+    Vector<int32_t> lost;
+    lost.push(10);
+
+    Vector<TraceEvent> trace;
+    MakeTrace(40, lost, &trace);
+
+    // Only the last request is answered, after the hold would have run out
+    // had it not been stretched.
+    trace.push(MakeEvent(23000ll, 10));
+
+    TraceReplayer replayer;
+    replayer.replay(trace, 40 * kPacketIntervalUs);
+
+    ExpectInOrder(replayer.mDequeued, 40);
+
+    EXPECT_EQ(23000ll, replayer.mDequeuedUs.itemAt(10));
+    EXPECT_EQ(3ll, GetStat(replayer.mJitterBuffer, "nacksSent"));
+    EXPECT_EQ(1ll, GetStat(replayer.mJitterBuffer, "nacksRecovered"));
+    EXPECT_EQ(0ll, GetStat(replayer.mJitterBuffer, "packetsDropped"));
+}
+
+TEST(JitterBufferTest, RetransmissionAfterSkipIsRejected) {
+    Vector<int32_t> lost;
+    lost.push(10);
+
+    Vector<TraceEvent> trace;
+    MakeTrace(40, lost, &trace);
+
+    trace.push(MakeEvent(30000ll, 10));
+
+    TraceReplayer replayer;
+    replayer.replay(trace, 40 * kPacketIntervalUs);
+
+    EXPECT_EQ(-1, replayer.indexOfDequeued(10));
+    EXPECT_EQ(1ll, GetStat(replayer.mJitterBuffer, "packetsLate"));
+    EXPECT_EQ(1ll, GetStat(replayer.mJitterBuffer, "packetsDropped"));
+}
+
+TEST(JitterBufferTest, AnsweredRequestsUpdateRTT) {
+    Vector<int32_t> lost;
+    for (int32_t extSeqNo = 10; extSeqNo < 200; extSeqNo += 10) {
+        lost.push(extSeqNo);
+    }
+
+    Vector<TraceEvent> trace;
+    MakeTrace(200, lost, &trace);
+
+    TraceReplayer replayer;
+    replayer.mRetransmitDelayUs = 3000ll;
+    replayer.replay(trace, 200 * kPacketIntervalUs);
+
+    ExpectInOrder(replayer.mDequeued, 200);
+
+    EXPECT_EQ((int64_t)lost.size(),
+              GetStat(replayer.mJitterBuffer, "nacksSent"));
+
+    EXPECT_EQ((int64_t)lost.size(),
+              GetStat(replayer.mJitterBuffer, "nacksRecovered"));
+
+    // Converging from the default of 5 ms.
+    int64_t rttUs = GetStat(replayer.mJitterBuffer, "rttUs");
+    EXPECT_LT(rttUs, 4000ll);
+    EXPECT_GE(rttUs, 3000ll);
+}
+
+TEST(JitterBufferTest, WindowOverflowSkipsAhead) {
+    JitterBuffer jitterBuffer;
+    Vector<int32_t> nacks;
+
+    for (int32_t extSeqNo = 0;
+            extSeqNo <= JitterBuffer::kPacketWindow; ++extSeqNo) {
+        EXPECT_TRUE(jitterBuffer.queueBuffer(
+                    MakePacket(extSeqNo, 0ll), 0ll, &nacks));
+    }
+
+    // Packet 0 had to make room.
+    EXPECT_EQ(1ll, GetStat(jitterBuffer, "packetsDropped"));
+
+    sp<ABuffer> buffer = jitterBuffer.dequeueBuffer(0ll, &nacks);
+    ASSERT_TRUE(buffer != NULL);
+    EXPECT_EQ(1, buffer->int32Data());
+
+    // Too old to be held anymore.
+    EXPECT_FALSE(jitterBuffer.queueBuffer(MakePacket(0, 0ll), 0ll, &nacks));
+}
+
+TEST(JitterBufferTest, JumpBeyondWindowDropsHeldPackets) {
+    JitterBuffer jitterBuffer;
+    Vector<int32_t> nacks;
+
+    for (int32_t extSeqNo = 0; extSeqNo < 10; ++extSeqNo) {
+        EXPECT_TRUE(jitterBuffer.queueBuffer(
+                    MakePacket(extSeqNo, 0ll), 0ll, &nacks));
+    }
+
+    int32_t farExtSeqNo = 5000;
+    EXPECT_TRUE(jitterBuffer.queueBuffer(
+                MakePacket(farExtSeqNo, 0ll), 0ll, &nacks));
+
+    // Only the 10 held packets count as dropped, not the sequence numbers
+    // that were never seen.
+    EXPECT_EQ(10ll, GetStat(jitterBuffer, "packetsDropped"));
+    EXPECT_EQ(188ll, jitterBuffer.totalBytesQueued());
+
+    // No retransmissions are requested for the jump itself.
+    EXPECT_EQ(0u, nacks.size());
+
+    // The packet arrived by itself, there's nothing to skip ahead from.
+    sp<ABuffer> buffer = jitterBuffer.dequeueBuffer(0ll, &nacks);
+    ASSERT_TRUE(buffer != NULL);
+    EXPECT_EQ(farExtSeqNo, buffer->int32Data());
+}
+
+TEST(JitterBufferTest, RandomLossAndReorderingIsRepaired) {
+    static const int32_t kNumPackets = 5000;
+
+    // Deterministic trace: 2% of the packets are lost, 5% delayed by up
+    // to 4 packet intervals.
+    uint32_t seed = 1;
+    Vector<int32_t> lost;
+    Vector<TraceEvent> trace;
+
+    for (int32_t extSeqNo = 0; extSeqNo < kNumPackets; ++extSeqNo) {
+        seed = seed * 1103515245 + 12345;
+
+        // Leave the first packet alone, it sets the start of the stream.
+        uint32_t r = (extSeqNo > 0) ? (seed >> 16) % 100 : 100;
+
+        if (r < 2) {
+            lost.push(extSeqNo);
+            continue;
+        }
+
+        TraceEvent event = MakeEvent(extSeqNo * kPacketIntervalUs, extSeqNo);
+
+        if (r < 7) {
+            event.mTimeUs += (1 + (seed >> 8) % 4) * kPacketIntervalUs;
+        }
+
+        trace.push(event);
+    }
+
+    ASSERT_GT(lost.size(), 0u);
+
+    TraceReplayer replayer;
+    replayer.mRetransmitDelayUs = 2000ll;
+    replayer.replay(trace, (kNumPackets + 100) * kPacketIntervalUs);
+
+    // Every loss was repaired in time, nothing was delivered twice or out
+    // of order.
+    ExpectInOrder(replayer.mDequeued, kNumPackets);
+
+    EXPECT_GE(GetStat(replayer.mJitterBuffer, "nacksRecovered"),
+              (int64_t)lost.size());
+
+    EXPECT_EQ(0ll, GetStat(replayer.mJitterBuffer, "packetsDropped"));
+}
+
+// Replays the trace named by $JITTER_BUFFER_TRACE, see LoadTrace(), with
+// requested retransmissions arriving 2ms later.
+TEST(JitterBufferTest, RecordedTraceIsDequeuedInOrder) {
+    const char *path = getenv(kTraceEnvVar);
+    if (path == NULL) {
+        ALOGI("%s not set, skipping recorded trace", kTraceEnvVar);
+        return;
+    }
+
+    Vector<TraceEvent> trace;
+    ASSERT_TRUE(LoadTrace(path, &trace)) << path;
+    ASSERT_FALSE(trace.isEmpty()) << path;
+
+    TraceReplayer replayer;
+    replayer.mRetransmitDelayUs = 2000ll;
+    replayer.replay(trace, trace.top().mTimeUs + 1000000ll);
+
+    EXPECT_EQ(0u, replayer.countOutOfOrder());
+
+    const char *kStats[] = {
+        "jitterUs", "targetDelayUs", "rttUs", "nacksSent", "nacksRecovered",
+        "packetsDropped", "packetsLate", "packetsDuplicate",
+    };
+
+    printf("%s: %d packets, %d dequeued\n",
+           path, (int)trace.size(), (int)replayer.mDequeued.size());
+
+    for (size_t i = 0; i < sizeof(kStats) / sizeof(kStats[0]); ++i) {
+        printf("  %s: %lld\n",
+               kStats[i], GetStat(replayer.mJitterBuffer, kStats[i]));
+    }
+}
+
+TEST(JitterBufferTest, GenericNACKsCoverFollowingPackets) {
+    Vector<int32_t> nacks;
+    nacks.push(10);
+    nacks.push(11);
+    nacks.push(26);
+    nacks.push(27);     // 17 after 10, starts a new entry.
+    nacks.push(0xfffe);
+    nacks.push(0x0001); // Wraps around, still 3 after 0xfffe.
+
+    Vector<uint32_t> entries;
+    JitterBuffer::GetGenericNACKs(nacks, &entries);
+
+    ASSERT_EQ(3u, entries.size());
+    EXPECT_EQ((10u << 16) | 0x8001, entries.itemAt(0));
+    EXPECT_EQ((27u << 16) | 0x0000, entries.itemAt(1));
+    EXPECT_EQ((0xfffeu << 16) | 0x0004, entries.itemAt(2));
+
+    JitterBuffer::GetGenericNACKs(Vector<int32_t>(), &entries);
+    EXPECT_TRUE(entries.isEmpty());
+}
+
+}  // namespace android